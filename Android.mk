@@ -21,4 +21,16 @@ LOCAL_MODULE:= libhardware
 
 include $(BUILD_SHARED_LIBRARY)
 
+# Generator of the HAL module index read by hardware.c, see hal_index.h
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := hal_index_gen.c
+LOCAL_MODULE := hal_index_gen
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := hal_index_gen.c
+LOCAL_MODULE := hal_index_gen
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
+
 include $(SUBDIR_MAKEFILES)
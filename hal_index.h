@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HAL_INDEX_H
+#define ANDROID_HAL_INDEX_H
+
+#include <stdint.h>
+
+/**
+ * Layout of the index file listing the modules present in a HAL directory,
+ * written by hal_index_gen and read by the loader in hardware.c.
+ *
+ * The file is a hal_index_header, followed by 'count' uint32_t offsets of
+ * the module names in the string table, sorted by name, followed by the
+ * string table itself. Each name is the file name of a module without the
+ * ".so" suffix, e.g. "gralloc.default", and is NUL-terminated.
+ *
+ * All values are in native byte order. The index is considered stale, and
+ * ignored, when the directory was modified after the index file was
+ * written.
+ */
+
+#define HAL_INDEX_FILE_NAME "hw_modules.idx"
+
+#define HAL_INDEX_MAGIC     0x58444948  /* "HIDX" */
+#define HAL_INDEX_VERSION   1
+
+struct hal_index_header {
+    uint32_t magic;
+    uint32_t version;
+
+    /** Number of modules in the index */
+    uint32_t count;
+
+    /** Size of the string table in bytes */
+    uint32_t strings_size;
+};
+
+#endif  /* ANDROID_HAL_INDEX_H */
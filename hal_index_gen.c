@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Write the index of the HAL modules found in each directory given on the
+ * command line, e.g.
+ *
+ *   hal_index_gen /system/lib/hw /vendor/lib/hw
+ *
+ * See hal_index.h for the file format.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hal_index.h"
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int generate_index(const char *dir_path)
+{
+    DIR *dir;
+    struct dirent *de;
+    char **names = NULL;
+    uint32_t *offsets = NULL;
+    size_t count = 0, capacity = 0, strings_size = 0, i;
+    struct hal_index_header hdr;
+    char path[PATH_MAX];
+    int fd, status = -1;
+
+    dir = opendir(dir_path);
+    if (dir == NULL) {
+        fprintf(stderr, "%s: %s\n", dir_path, strerror(errno));
+        return -1;
+    }
+
+    while ((de = readdir(dir)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len <= 3 || strcmp(de->d_name + len - 3, ".so") != 0)
+            continue;
+        if (count == capacity) {
+            char **n;
+            capacity = capacity ? capacity * 2 : 32;
+            n = realloc(names, capacity * sizeof(*names));
+            if (n == NULL)
+                goto done;
+            names = n;
+        }
+        names[count] = strndup(de->d_name, len - 3);
+        if (names[count] == NULL)
+            goto done;
+        count++;
+    }
+
+    qsort(names, count, sizeof(*names), compare_names);
+
+    offsets = malloc((count ? count : 1) * sizeof(*offsets));
+    if (offsets == NULL)
+        goto done;
+    for (i = 0; i < count; i++) {
+        offsets[i] = strings_size;
+        strings_size += strlen(names[i]) + 1;
+    }
+
+    hdr.magic = HAL_INDEX_MAGIC;
+    hdr.version = HAL_INDEX_VERSION;
+    hdr.count = count;
+    /* keep the string table non-empty, the loader relies on it */
+    hdr.strings_size = strings_size ? strings_size : 1;
+
+    /*
+     * Write the index in place rather than through a rename: renaming would
+     * update the mtime of the directory after the one of the index, and the
+     * loader would consider the index stale.
+     */
+    snprintf(path, sizeof(path), "%s/%s", dir_path, HAL_INDEX_FILE_NAME);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        goto done;
+    }
+    if (write_all(fd, &hdr, sizeof(hdr)) < 0 ||
+            write_all(fd, offsets, count * sizeof(*offsets)) < 0) {
+        goto write_failed;
+    }
+    for (i = 0; i < count; i++) {
+        if (write_all(fd, names[i], strlen(names[i]) + 1) < 0)
+            goto write_failed;
+    }
+    if (count == 0 && write_all(fd, "", 1) < 0)
+        goto write_failed;
+    if (fsync(fd) < 0)
+        goto write_failed;
+
+    printf("%s: %zu modules\n", path, count);
+    status = 0;
+
+write_failed:
+    if (status != 0)
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    close(fd);
+done:
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    free(offsets);
+    closedir(dir);
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    int i, status = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <hal directory>...\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (generate_index(argv[i]) < 0)
+            status = 1;
+    }
+    return status;
+}
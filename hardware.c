@@ -19,14 +19,45 @@
 #include <cutils/properties.h>
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define LOG_TAG "HAL"
 #include <utils/Log.h>
 
+#include "hal_index.h"
+
+/**
+ * Binding policy of the modules: "now" (the default) resolves every symbol
+ * when the module is loaded, "lazy" defers it to the first call. The policy
+ * of module <name> can be overridden with the property
+ * HAL_BIND_PROPERTY.<name>. Note that some dynamic linkers always bind
+ * everything at load time regardless.
+ */
+#define HAL_BIND_PROPERTY "hal.bind"
+
+/**
+ * Set to 1 to track the devices opened on each module, so that
+ * hw_unload_module() can refuse to unload a module still in use and
+ * hw_get_loaded_modules() can list them. Tracking replaces the methods of
+ * the modules and the close method of their devices with shims, it is off
+ * by default and only read when a module is loaded.
+ */
+#define HAL_TRACK_DEVICES_PROPERTY "hal.track_devices"
+
+/** Maximum number of threads used by hw_preload_modules() */
+#define HAL_PRELOAD_MAX_THREADS 4
+
 /** Base path of the hal modules */
 #define HAL_LIBRARY_PATH1 "/system/lib/hw"
 #define HAL_LIBRARY_PATH2 "/vendor/lib/hw"
@@ -54,24 +85,171 @@ static const int HAL_VARIANT_KEYS_COUNT =
     (sizeof(variant_keys)/sizeof(variant_keys[0]));
 
 /**
- * Load the file defined by the variant and if successful
- * return the dlopen handle and the hmi.
+ * The HAL directories, in the order they are searched. The list is built
+ * once, when the first module is looked up, from the first of:
+ *
+ *  - the environment variable HAL_LIBRARY_PATH_ENV, a ':' separated list,
+ *    only honored on debuggable builds (ro.debuggable=1) and outside of
+ *    setuid/setgid processes, for tests and benchmarks,
+ *  - the file HAL_LIBRARY_PATH_CONFIG, one directory per line, where '#'
+ *    starts a comment,
+ *  - HAL_LIBRARY_PATH2 then HAL_LIBRARY_PATH1.
+ *
+ * Each directory may carry an index of the modules it contains (see
+ * hal_index.h), which is mapped along with the list. When the index is
+ * missing or stale, the directory is probed with access() instead.
+ */
+#define HAL_LIBRARY_PATH_ENV    "HAL_LIBRARY_PATH"
+#define HAL_LIBRARY_PATH_CONFIG "/system/etc/hal_library_path.conf"
+
+/** Maximum size of HAL_LIBRARY_PATH_CONFIG */
+#define HAL_LIBRARY_PATH_CONFIG_MAX 4096
+
+struct hal_dir {
+    const char *path;
+    const struct hal_index_header *index;
+    size_t index_size;
+};
+
+static struct hal_dir default_hal_dirs[] = {
+    { HAL_LIBRARY_PATH2, NULL, 0 },
+    { HAL_LIBRARY_PATH1, NULL, 0 },
+};
+
+static struct hal_dir *hal_dirs;
+static int hal_dirs_count;
+
+static pthread_once_t hal_dirs_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Process-wide registry of the modules resolved so far, keyed by
+ * (class_id, inst). A lookup that hits the registry skips the property
+ * reads, the access() probes and the dlopen/dlsym done by load().
+ *
+ * An entry is inserted in the LOADING state before the registry lock is
+ * dropped to load the module, so that concurrent lookups of the same module
+ * wait for the first one instead of loading it again. Failed lookups are not
+ * memoized: a module installed later is still found.
+ */
+enum {
+    MODULE_ENTRY_LOADING,
+    MODULE_ENTRY_LOADED
+};
+
+/** What it took to load a module, see hw_get_module_load_stats() */
+struct load_info {
+    const struct hw_module_t *hmi;
+    void *handle;
+    int flags;
+    int64_t size;
+    int64_t dlopen_ns;
+    int64_t dlsym_ns;
+    int64_t load_ns;
+    char variant[PROPERTY_VALUE_MAX];
+    char path[PATH_MAX];
+};
+
+/**
+ * A module loaded in the process, shared by all the registry entries that
+ * resolved to it. It owns the dlopen handle, which is only released by
+ * hw_unload_module(). When HAL_TRACK_DEVICES_PROPERTY is set, it also tracks
+ * the devices opened on the module: its methods are replaced with
+ * device_open_shim(), which in turn replaces the close method of each
+ * device it opens with device_close_shim(). Otherwise the module is left
+ * untouched and its devices are not known.
+ */
+struct open_device {
+    struct open_device *next;
+    struct hw_device_t *device;
+    int (*close)(struct hw_device_t *device);
+};
+
+struct loaded_module {
+    struct loaded_module *next;
+    struct hw_module_t *hmi;
+    void *handle;
+    struct hw_module_methods_t *methods;
+    struct hw_module_methods_t shim_methods;
+    struct open_device *devices;
+    uint32_t num_devices;
+    uint32_t opening;
+    uint32_t lookups;
+    char path[PATH_MAX];
+};
+
+struct module_entry {
+    struct module_entry *next;
+    char *class_id;
+    char *inst;
+    int state;
+    struct loaded_module *module;
+    struct load_info info;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t registry_cond = PTHREAD_COND_INITIALIZER;
+static struct module_entry *registry;
+static struct loaded_module *loaded_modules;
+static uint32_t registry_hits;
+static uint32_t registry_misses;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Get the dlopen() binding mode of module 'name' from HAL_BIND_PROPERTY.
+ */
+static int get_bind_flags(const char *name)
+{
+    char key[PROPERTY_KEY_MAX];
+    char value[PROPERTY_VALUE_MAX];
+
+    if (snprintf(key, sizeof(key), "%s.%s", HAL_BIND_PROPERTY, name) >=
+            (int)sizeof(key) || property_get(key, value, NULL) == 0) {
+        property_get(HAL_BIND_PROPERTY, value, "now");
+    }
+    if (strcmp(value, "lazy") == 0)
+        return RTLD_LAZY;
+    if (strcmp(value, "now") != 0)
+        ALOGW("unknown binding mode '%s' for %s, using 'now'", value, name);
+    return RTLD_NOW;
+}
+
+static int track_devices(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(HAL_TRACK_DEVICES_PROPERTY, value, "0");
+    return strcmp(value, "1") == 0;
+}
+
+/**
+ * Load the file info->path with the binding mode info->flags and if
+ * successful return the dlopen handle and the hmi in 'info', along with
+ * the time spent in dlopen and dlsym.
  * @return 0 = success, !0 = failure.
  */
-static int load(const char *id,
-        const char *path,
-        const struct hw_module_t **pHmi)
+static int load(const char *id, struct load_info *info)
 {
     int status;
     void *handle;
     struct hw_module_t *hmi;
+    const char *path = info->path;
+    struct stat st;
+    int64_t t0, t1, t2;
 
     /*
-     * load the symbols resolving undefined symbols before
-     * dlopen returns. Since RTLD_GLOBAL is not or'd in with
-     * RTLD_NOW the external symbols will not be global
+     * load the symbols, resolving undefined symbols before dlopen returns
+     * unless lazy binding was asked for. Since RTLD_GLOBAL is not or'd in
+     * the external symbols will not be global
      */
-    handle = dlopen(path, RTLD_NOW);
+    t0 = now_ns();
+    handle = dlopen(path, info->flags);
+    t1 = now_ns();
     if (handle == NULL) {
         char const *err_str = dlerror();
         ALOGE("load: module=%s\n%s", path, err_str?err_str:"unknown");
@@ -82,6 +260,7 @@ static int load(const char *id,
     /* Get the address of the struct hal_module_info. */
     const char *sym = HAL_MODULE_INFO_SYM_AS_STR;
     hmi = (struct hw_module_t *)dlsym(handle, sym);
+    t2 = now_ns();
     if (hmi == NULL) {
         ALOGE("load: couldn't find symbol %s", sym);
         status = -EINVAL;
@@ -95,9 +274,7 @@ static int load(const char *id,
         goto done;
     }
 
-	//codewalker
-	if(hmi->dso)
-    	hmi->dso = handle;
+    hmi->dso = handle;
 
     /* success */
     status = 0;
@@ -111,24 +288,482 @@ static int load(const char *id,
         }
     } else {
         ALOGV("loaded HAL id=%s path=%s hmi=%p handle=%p",
-                id, path, *pHmi, handle);
+                id, path, hmi, handle);
+        info->dlopen_ns = t1 - t0;
+        info->dlsym_ns = t2 - t1;
+        info->size = stat(path, &st) == 0 ? st.st_size : -1;
+    }
+
+    info->hmi = hmi;
+    info->handle = handle;
+
+    return status;
+}
+
+static int streq(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/* Must be called with registry_lock held. */
+static struct module_entry *registry_find_locked(const char *class_id,
+        const char *inst)
+{
+    struct module_entry *e;
+    for (e = registry; e != NULL; e = e->next) {
+        if (streq(e->class_id, class_id) && streq(e->inst, inst))
+            return e;
+    }
+    return NULL;
+}
+
+/* Must be called with registry_lock held. */
+static void registry_remove_locked(struct module_entry *entry)
+{
+    struct module_entry **pe;
+    for (pe = &registry; *pe != NULL; pe = &(*pe)->next) {
+        if (*pe == entry) {
+            *pe = entry->next;
+            break;
+        }
+    }
+}
+
+static void registry_free_entry(struct module_entry *e)
+{
+    free(e->class_id);
+    free(e->inst);
+    free(e);
+}
+
+static struct module_entry *registry_new_entry(const char *class_id,
+        const char *inst)
+{
+    struct module_entry *e = calloc(1, sizeof(*e));
+    if (e == NULL)
+        return NULL;
+    e->class_id = strdup(class_id);
+    e->inst = inst ? strdup(inst) : NULL;
+    if (e->class_id == NULL || (inst && e->inst == NULL)) {
+        registry_free_entry(e);
+        return NULL;
+    }
+    e->state = MODULE_ENTRY_LOADING;
+    return e;
+}
+
+/* Must be called with registry_lock held. */
+static struct loaded_module *find_loaded_module_locked(
+        const struct hw_module_t *hmi)
+{
+    struct loaded_module *lm;
+    for (lm = loaded_modules; lm != NULL; lm = lm->next) {
+        if (lm->hmi == hmi)
+            return lm;
+    }
+    return NULL;
+}
+
+static int device_close_shim(struct hw_device_t *device)
+{
+    struct loaded_module *lm;
+    struct open_device **pod, *od = NULL;
+    int (*close_device)(struct hw_device_t *device);
+
+    pthread_mutex_lock(&registry_lock);
+    for (lm = loaded_modules; lm != NULL && od == NULL; lm = lm->next) {
+        for (pod = &lm->devices; *pod != NULL; pod = &(*pod)->next) {
+            if ((*pod)->device == device) {
+                od = *pod;
+                *pod = od->next;
+                lm->num_devices--;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (od == NULL) {
+        ALOGE("close: unknown device %p", device);
+        return -EINVAL;
+    }
+    close_device = od->close;
+    free(od);
+    device->close = close_device;
+    return close_device(device);
+}
+
+static int device_open_shim(const struct hw_module_t *module, const char *id,
+        struct hw_device_t **device)
+{
+    struct loaded_module *lm;
+    struct hw_module_methods_t *methods = NULL;
+    struct open_device *od;
+    int status;
+
+    pthread_mutex_lock(&registry_lock);
+    lm = find_loaded_module_locked(module);
+    if (lm != NULL) {
+        methods = lm->methods;
+        lm->opening++;
     }
+    pthread_mutex_unlock(&registry_lock);
+    if (methods == NULL)
+        return -EINVAL;
 
-    *pHmi = hmi;
+    status = methods->open(module, id, device);
+    od = NULL;
+    if (status == 0 && *device != NULL &&
+            (*device)->close != device_close_shim) {
+        od = malloc(sizeof(*od));
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    if (od != NULL) {
+        od->device = *device;
+        od->close = (*device)->close;
+        od->next = lm->devices;
+        lm->devices = od;
+        lm->num_devices++;
+        (*device)->close = device_close_shim;
+    }
+    lm->opening--;
+    pthread_mutex_unlock(&registry_lock);
 
     return status;
 }
 
+/**
+ * Track the module loaded in 'info', or if it was already loaded through
+ * another registry entry, drop the extra dlopen reference taken by load().
+ * Must be called with registry_lock held.
+ */
+static struct loaded_module *track_loaded_module_locked(struct load_info *info)
+{
+    struct hw_module_t *hmi = (struct hw_module_t *)info->hmi;
+    struct loaded_module *lm = find_loaded_module_locked(hmi);
+
+    if (lm != NULL) {
+        dlclose(info->handle);
+        info->handle = lm->handle;
+    } else {
+        lm = calloc(1, sizeof(*lm));
+        if (lm == NULL)
+            return NULL;
+        lm->hmi = hmi;
+        lm->handle = info->handle;
+        lm->methods = hmi->methods;
+        lm->shim_methods.open = device_open_shim;
+        strlcpy(lm->path, info->path, sizeof(lm->path));
+        if (lm->methods != NULL && track_devices())
+            hmi->methods = &lm->shim_methods;
+        lm->next = loaded_modules;
+        loaded_modules = lm;
+    }
+    lm->lookups++;
+    return lm;
+}
+
+static int timespec_after(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec > b->tv_sec ||
+            (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
+
+/**
+ * Map the index of directory 'dir' if it exists, is well formed, and the
+ * directory has not been modified since the index was written.
+ */
+static void map_hal_index(struct hal_dir *dir)
+{
+    char path[PATH_MAX];
+    struct stat dir_st, st;
+    const struct hal_index_header *hdr;
+    const uint32_t *offsets;
+    const char *strings;
+    void *base;
+    size_t size;
+    uint32_t i;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir->path, HAL_INDEX_FILE_NAME);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    if (fstat(fd, &st) < 0 || stat(dir->path, &dir_st) < 0 ||
+            st.st_size < (off_t)sizeof(*hdr) ||
+            (uint64_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        return;
+    }
+    /*
+     * Compare the nanoseconds too: a module copied in the same second the
+     * index was written must not be hidden by it.
+     */
+    if (timespec_after(&dir_st.st_mtim, &st.st_mtim)) {
+        ALOGW("%s is stale, probing %s instead", path, dir->path);
+        close(fd);
+        return;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        ALOGE("couldn't map %s (%s)", path, strerror(errno));
+        return;
+    }
+
+    /*
+     * Check each part against the space left in the file before adding it,
+     * so that a corrupt count or strings_size cannot wrap the size around.
+     */
+    hdr = base;
+    size = st.st_size - sizeof(*hdr);
+    if (hdr->magic != HAL_INDEX_MAGIC || hdr->version != HAL_INDEX_VERSION ||
+            hdr->count > size / sizeof(uint32_t)) {
+        goto invalid;
+    }
+    size -= (size_t)hdr->count * sizeof(uint32_t);
+    if (hdr->strings_size == 0 || hdr->strings_size != size)
+        goto invalid;
+
+    offsets = (const uint32_t *)(hdr + 1);
+    strings = (const char *)(offsets + hdr->count);
+    if (strings[hdr->strings_size - 1] != '\0')
+        goto invalid;
+    for (i = 0; i < hdr->count; i++) {
+        if (offsets[i] >= hdr->strings_size)
+            goto invalid;
+    }
+
+    dir->index = hdr;
+    dir->index_size = st.st_size;
+    return;
+
+invalid:
+    ALOGE("%s is corrupt, ignoring it", path);
+    munmap(base, st.st_size);
+}
+
+static void add_hal_dir(const char *path, size_t len)
+{
+    struct hal_dir *dirs;
+    char *p;
+
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    if (len == 0)
+        return;
+
+    dirs = realloc(hal_dirs, (hal_dirs_count + 1) * sizeof(*dirs));
+    if (dirs == NULL)
+        return;
+    hal_dirs = dirs;
+    p = strndup(path, len);
+    if (p == NULL)
+        return;
+    memset(&hal_dirs[hal_dirs_count], 0, sizeof(*hal_dirs));
+    hal_dirs[hal_dirs_count++].path = p;
+}
+
+static const char *find_char_or_end(const char *s, int c)
+{
+    const char *p = strchr(s, c);
+    return p ? p : s + strlen(s);
+}
+
+static void parse_hal_path_list(const char *list)
+{
+    const char *end;
+
+    for (; *list != '\0'; list = *end ? end + 1 : end) {
+        end = find_char_or_end(list, ':');
+        add_hal_dir(list, end - list);
+    }
+}
+
+static void parse_hal_path_config(const char *config)
+{
+    const char *line, *end, *p;
+
+    for (line = config; *line != '\0'; line = *end ? end + 1 : end) {
+        end = find_char_or_end(line, '\n');
+        p = memchr(line, '#', end - line);
+        if (p == NULL)
+            p = end;
+        while (line < p && (*line == ' ' || *line == '\t'))
+            line++;
+        while (p > line && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\r'))
+            p--;
+        add_hal_dir(line, p - line);
+    }
+}
+
+static void read_hal_path_config(void)
+{
+    char buf[HAL_LIBRARY_PATH_CONFIG_MAX];
+    ssize_t len;
+    int fd;
+
+    fd = open(HAL_LIBRARY_PATH_CONFIG, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len < 0) {
+        ALOGE("couldn't read %s (%s)", HAL_LIBRARY_PATH_CONFIG,
+                strerror(errno));
+        return;
+    }
+    buf[len] = '\0';
+    parse_hal_path_config(buf);
+}
+
+/**
+ * Get the search path list from HAL_LIBRARY_PATH_ENV, or NULL if it is not
+ * set or not honored in this process.
+ */
+static const char *get_hal_path_env(void)
+{
+    char value[PROPERTY_VALUE_MAX];
+    const char *list = getenv(HAL_LIBRARY_PATH_ENV);
+
+    if (list == NULL || list[0] == '\0')
+        return NULL;
+    property_get("ro.debuggable", value, "0");
+    if (strcmp(value, "1") != 0 || getauxval(AT_SECURE)) {
+        ALOGW("ignoring %s, not a debuggable build or a setuid process",
+                HAL_LIBRARY_PATH_ENV);
+        return NULL;
+    }
+    return list;
+}
+
+static void init_hal_dirs(void)
+{
+    int i;
+    const char *list = get_hal_path_env();
+
+    if (list != NULL)
+        parse_hal_path_list(list);
+    else
+        read_hal_path_config();
+
+    if (hal_dirs_count == 0) {
+        free(hal_dirs);
+        hal_dirs = default_hal_dirs;
+        hal_dirs_count = sizeof(default_hal_dirs)/sizeof(default_hal_dirs[0]);
+    }
+
+    for (i = 0; i < hal_dirs_count; i++) {
+        ALOGV("HAL search path %d: %s", i, hal_dirs[i].path);
+        map_hal_index(&hal_dirs[i]);
+    }
+}
+
+/**
+ * Binary search for the module file "<name>.<variant>.so" in 'index'.
+ */
+static int hal_index_contains(const struct hal_index_header *index,
+        const char *name, const char *variant)
+{
+    const uint32_t *offsets = (const uint32_t *)(index + 1);
+    const char *strings = (const char *)(offsets + index->count);
+    char key[PATH_MAX];
+    uint32_t lo = 0, hi = index->count;
+
+    snprintf(key, sizeof(key), "%s.%s", name, variant);
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(key, strings + offsets[mid]);
+        if (cmp == 0)
+            return 1;
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return 0;
+}
+
+/**
+ * Check whether module file "<name>.<variant>.so" exists in 'dir', and if so
+ * return its full name in 'path'.
+ */
+static int hal_dir_has_module(const struct hal_dir *dir, const char *name,
+        const char *variant, char *path, size_t path_len)
+{
+    if (dir->index != NULL && !hal_index_contains(dir->index, name, variant))
+        return 0;
+    snprintf(path, path_len, "%s/%s.%s.so", dir->path, name, variant);
+    return dir->index != NULL || access(path, R_OK) == 0;
+}
+
+/**
+ * Look for the file of module 'name' through the configuration variants.
+ * @return 0 and the file name and variant in 'info' if found,
+ * -ENOENT otherwise.
+ */
+static int find_module_path(const char *name, struct load_info *info)
+{
+    int i, j;
+    char *prop = info->variant;
+
+    pthread_once(&hal_dirs_once, init_hal_dirs);
+
+    /* Loop through the configuration variants looking for a module */
+    for (i=0 ; i<HAL_VARIANT_KEYS_COUNT+1 ; i++) {
+        if (i < HAL_VARIANT_KEYS_COUNT) {
+            if (property_get(variant_keys[i], prop, NULL) == 0) {
+                continue;
+            }
+        } else {
+            strlcpy(prop, "default", sizeof(info->variant));
+        }
+        for (j = 0; j < hal_dirs_count; j++) {
+            if (hal_dir_has_module(&hal_dirs[j], name, prop,
+                    info->path, sizeof(info->path)))
+                return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
 int hw_get_module_by_class(const char *class_id, const char *inst,
                            const struct hw_module_t **module)
 {
     int status;
-    int i;
-    const struct hw_module_t *hmi = NULL;
-    char prop[PATH_MAX];
-    char path[PATH_MAX];
+    struct module_entry *entry;
+    struct load_info info;
+    int64_t start;
     char name[PATH_MAX];
 
+    pthread_mutex_lock(&registry_lock);
+    while ((entry = registry_find_locked(class_id, inst)) != NULL &&
+            entry->state == MODULE_ENTRY_LOADING) {
+        pthread_cond_wait(&registry_cond, &registry_lock);
+    }
+    if (entry != NULL) {
+        registry_hits++;
+        if (entry->module != NULL)
+            entry->module->lookups++;
+        *module = entry->info.hmi;
+        pthread_mutex_unlock(&registry_lock);
+        return 0;
+    }
+    registry_misses++;
+    entry = registry_new_entry(class_id, inst);
+    if (entry != NULL) {
+        entry->next = registry;
+        registry = entry;
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    start = now_ns();
     if (inst)
         snprintf(name, PATH_MAX, "%s.%s", class_id, inst);
     else
@@ -140,42 +775,320 @@ int hw_get_module_by_class(const char *class_id, const char *inst,
      * a new copy of the library).
      * We also assume that dlopen() is thread-safe.
      */
+    memset(&info, 0, sizeof(info));
+    status = find_module_path(name, &info);
+    if (status == 0) {
+        /* load the module, if this fails, we're doomed, and we should not try
+         * to load a different variant. */
+        info.flags = get_bind_flags(name);
+        status = load(class_id, &info);
+        info.load_ns = now_ns() - start;
+    }
+    *module = info.hmi;
 
-    /* Loop through the configuration variants looking for a module */
-    for (i=0 ; i<HAL_VARIANT_KEYS_COUNT+1 ; i++) {
-        if (i < HAL_VARIANT_KEYS_COUNT) {
-            if (property_get(variant_keys[i], prop, NULL) == 0) {
-                continue;
-            }
-            snprintf(path, sizeof(path), "%s/%s.%s.so",
-                     HAL_LIBRARY_PATH2, name, prop);
-            if (access(path, R_OK) == 0) break;
+    pthread_mutex_lock(&registry_lock);
+    if (entry != NULL) {
+        if (status == 0) {
+            entry->state = MODULE_ENTRY_LOADED;
+            entry->module = track_loaded_module_locked(&info);
+            entry->info = info;
+        } else {
+            registry_remove_locked(entry);
+            registry_free_entry(entry);
+        }
+        pthread_cond_broadcast(&registry_cond);
+    } else if (status == 0) {
+        track_loaded_module_locked(&info);
+    }
+    pthread_mutex_unlock(&registry_lock);
 
-            snprintf(path, sizeof(path), "%s/%s.%s.so",
-                     HAL_LIBRARY_PATH1, name, prop);
-            if (access(path, R_OK) == 0) break;
+    return status;
+}
+
+int hw_get_module(const char *id, const struct hw_module_t **module)
+{
+    return hw_get_module_by_class(id, NULL, module);
+}
+
+void hw_invalidate_module_cache(const char *class_id, const char *inst)
+{
+    struct module_entry **pe;
+
+    pthread_mutex_lock(&registry_lock);
+    pe = &registry;
+    while (*pe != NULL) {
+        struct module_entry *e = *pe;
+        if (e->state == MODULE_ENTRY_LOADED &&
+                (class_id == NULL ||
+                 (streq(e->class_id, class_id) && streq(e->inst, inst)))) {
+            /* The module itself stays loaded: it may still be in use by
+             * whoever looked it up before. */
+            *pe = e->next;
+            registry_free_entry(e);
         } else {
-            snprintf(path, sizeof(path), "%s/%s.default.so",
-                     HAL_LIBRARY_PATH2, name);
-            if (access(path, R_OK) == 0) break;
+            pe = &e->next;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+void hw_get_module_cache_stats(struct hw_module_cache_stats *stats)
+{
+    struct module_entry *e;
+
+    pthread_mutex_lock(&registry_lock);
+    stats->hits = registry_hits;
+    stats->misses = registry_misses;
+    stats->entries = 0;
+    for (e = registry; e != NULL; e = e->next) {
+        if (e->state == MODULE_ENTRY_LOADED)
+            stats->entries++;
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+struct preload_state {
+    pthread_mutex_t lock;
+    const char **ids;
+    size_t count;
+    size_t next;
+    int status;
+};
+
+static void *preload_worker(void *arg)
+{
+    struct preload_state *state = arg;
+    const struct hw_module_t *hmi;
+    int64_t start;
+    size_t i;
+    int err;
+
+    for (;;) {
+        pthread_mutex_lock(&state->lock);
+        i = state->next++;
+        pthread_mutex_unlock(&state->lock);
+        if (i >= state->count)
+            break;
 
-            snprintf(path, sizeof(path), "%s/%s.default.so",
-                     HAL_LIBRARY_PATH1, name);
-            if (access(path, R_OK) == 0) break;
+        start = now_ns();
+        err = hw_get_module(state->ids[i], &hmi);
+        if (err == 0) {
+            ALOGI("preloaded HAL id=%s in %lld us", state->ids[i],
+                    (long long)(now_ns() - start) / 1000);
+        } else {
+            ALOGE("preload: id=%s failed (%s)", state->ids[i], strerror(-err));
+            pthread_mutex_lock(&state->lock);
+            if (state->status == 0)
+                state->status = err;
+            pthread_mutex_unlock(&state->lock);
         }
     }
+    return NULL;
+}
 
-    status = -ENOENT;
-    if (i < HAL_VARIANT_KEYS_COUNT+1) {
-        /* load the module, if this fails, we're doomed, and we should not try
-         * to load a different variant. */
-        status = load(class_id, path, module);
+int hw_preload_modules(const char **ids, size_t n)
+{
+    struct preload_state state;
+    pthread_t threads[HAL_PRELOAD_MAX_THREADS];
+    size_t num_threads, started, i;
+    long cpus;
+    int64_t start = now_ns();
+
+    if (ids == NULL && n > 0)
+        return -EINVAL;
+
+    pthread_mutex_init(&state.lock, NULL);
+    state.ids = ids;
+    state.count = n;
+    state.next = 0;
+    state.status = 0;
+
+    num_threads = n < HAL_PRELOAD_MAX_THREADS ? n : HAL_PRELOAD_MAX_THREADS;
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0 && (size_t)cpus < num_threads)
+        num_threads = cpus;
+
+    /* The calling thread is one of the workers. */
+    for (started = 0; started + 1 < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, preload_worker, &state))
+            break;
+    }
+    preload_worker(&state);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&state.lock);
+
+    ALOGI("preloaded %zu HAL modules on %zu threads in %lld us", n,
+            started + 1, (long long)(now_ns() - start) / 1000);
+    return state.status;
+}
+
+void hw_get_module_load_stats(hw_module_load_stats_cb cb, void *cookie)
+{
+    struct module_entry *e;
+    struct hw_module_load_stats stats;
+
+    pthread_mutex_lock(&registry_lock);
+    for (e = registry; e != NULL; e = e->next) {
+        if (e->state != MODULE_ENTRY_LOADED)
+            continue;
+        stats.class_id = e->class_id;
+        stats.inst = e->inst;
+        stats.path = e->info.path;
+        stats.variant = e->info.variant;
+        stats.lazy = e->info.flags == RTLD_LAZY;
+        stats.size = e->info.size;
+        stats.dlopen_ns = e->info.dlopen_ns;
+        stats.dlsym_ns = e->info.dlsym_ns;
+        stats.load_ns = e->info.load_ns;
+        cb(&stats, cookie);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+struct dump_state {
+    int fd;
+    int64_t total_ns;
+};
+
+static void dump_write(int fd, const char *fmt, ...)
+{
+    char buf[PATH_MAX + 256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (len >= (int)sizeof(buf))
+        len = sizeof(buf) - 1;
+    if (len > 0)
+        write(fd, buf, len);
+}
+
+static void dump_module_load_stats(const struct hw_module_load_stats *stats,
+        void *cookie)
+{
+    struct dump_state *state = cookie;
+
+    dump_write(state->fd, "  %s%s%s: %s (variant %s, %s, %lld bytes)\n"
+            "      dlopen %lld us, dlsym %lld us, total %lld us\n",
+            stats->class_id, stats->inst ? "." : "",
+            stats->inst ? stats->inst : "", stats->path, stats->variant,
+            stats->lazy ? "lazy" : "now", (long long)stats->size,
+            (long long)stats->dlopen_ns / 1000,
+            (long long)stats->dlsym_ns / 1000,
+            (long long)stats->load_ns / 1000);
+    state->total_ns += stats->load_ns;
+}
+
+void hw_dump_module_load_stats(int fd)
+{
+    struct dump_state state;
+    struct hw_module_cache_stats cache;
+
+    state.fd = fd;
+    state.total_ns = 0;
+
+    dump_write(fd, "Loaded HAL modules:\n");
+    hw_get_module_load_stats(dump_module_load_stats, &state);
+    hw_get_module_cache_stats(&cache);
+    dump_write(fd, "  %u modules loaded in %lld us, %u cache hits, "
+            "%u misses\n", cache.entries, (long long)state.total_ns / 1000,
+            cache.hits, cache.misses);
+}
+
+int hw_unload_module(const char *class_id, const char *inst)
+{
+    struct module_entry **pe, *entry;
+    struct loaded_module **plm, *lm;
+
+    pthread_mutex_lock(&registry_lock);
+    entry = registry_find_locked(class_id, inst);
+    if (entry == NULL || entry->state != MODULE_ENTRY_LOADED ||
+            entry->module == NULL) {
+        pthread_mutex_unlock(&registry_lock);
+        return -ENOENT;
+    }
+    lm = entry->module;
+    if (lm->num_devices > 0 || lm->opening > 0) {
+        pthread_mutex_unlock(&registry_lock);
+        ALOGE("unload: %s still has %u open devices", lm->path,
+                lm->num_devices);
+        return -EBUSY;
     }
 
+    /* Forget every registry entry that resolved to this module */
+    pe = &registry;
+    while (*pe != NULL) {
+        struct module_entry *e = *pe;
+        if (e->module == lm) {
+            *pe = e->next;
+            registry_free_entry(e);
+        } else {
+            pe = &e->next;
+        }
+    }
+    for (plm = &loaded_modules; *plm != NULL; plm = &(*plm)->next) {
+        if (*plm == lm) {
+            *plm = lm->next;
+            break;
+        }
+    }
+    if (lm->hmi->methods == &lm->shim_methods)
+        lm->hmi->methods = lm->methods;
+    lm->hmi->dso = NULL;
+    pthread_mutex_unlock(&registry_lock);
+
+    ALOGI("unloading HAL path=%s handle=%p", lm->path, lm->handle);
+    dlclose(lm->handle);
+    free(lm);
+    return 0;
+}
+
+int hw_reload_module(const char *class_id, const char *inst,
+        const struct hw_module_t **module)
+{
+    int status;
+
+    status = hw_get_module_by_class(class_id, inst, module);
+    if (status == 0)
+        status = hw_unload_module(class_id, inst);
+    if (status == 0)
+        status = hw_get_module_by_class(class_id, inst, module);
+    else
+        *module = NULL;
     return status;
 }
 
-int hw_get_module(const char *id, const struct hw_module_t **module)
+void hw_get_loaded_modules(hw_loaded_module_cb cb, void *cookie)
 {
-    return hw_get_module_by_class(id, NULL, module);
+    struct loaded_module *lm;
+    struct open_device *od;
+    struct hw_loaded_module info;
+    struct hw_device_t **devices;
+    size_t i;
+
+    pthread_mutex_lock(&registry_lock);
+    for (lm = loaded_modules; lm != NULL; lm = lm->next) {
+        devices = NULL;
+        if (lm->num_devices > 0) {
+            devices = malloc(lm->num_devices * sizeof(*devices));
+        }
+        i = 0;
+        if (devices != NULL) {
+            for (od = lm->devices; od != NULL; od = od->next)
+                devices[i++] = od->device;
+        }
+        info.module = lm->hmi;
+        info.path = lm->path;
+        info.handle = lm->handle;
+        info.lookups = lm->lookups;
+        info.num_devices = i;
+        info.devices = devices;
+        cb(&info, cookie);
+        free(devices);
+    }
+    pthread_mutex_unlock(&registry_lock);
 }
@@ -17,6 +17,7 @@
 #ifndef ANDROID_INCLUDE_HARDWARE_HARDWARE_H
 #define ANDROID_INCLUDE_HARDWARE_HARDWARE_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/cdefs.h>
 
@@ -225,6 +226,142 @@ int hw_get_module(const char *id, const struct hw_module_t **module);
 int hw_get_module_by_class(const char *class_id, const char *inst,
                            const struct hw_module_t **module);
 
+/**
+ * Modules returned by hw_get_module() and hw_get_module_by_class() are
+ * remembered for the lifetime of the process, so that later lookups of the
+ * same class_id/inst pair neither probe the filesystem nor dlopen() the
+ * module again.
+ *
+ * Forget the module cached for class 'class_id' and instance 'inst', or
+ * every cached module if 'class_id' is NULL. The next lookup resolves the
+ * module from scratch. Modules already returned stay loaded and valid.
+ */
+void hw_invalidate_module_cache(const char *class_id, const char *inst);
+
+struct hw_module_cache_stats {
+    /** Lookups served from the cache */
+    uint32_t hits;
+
+    /** Lookups that had to resolve and load the module */
+    uint32_t misses;
+
+    /** Number of modules currently cached */
+    uint32_t entries;
+};
+
+/**
+ * Get the module cache counters since the process started.
+ */
+void hw_get_module_cache_stats(struct hw_module_cache_stats *stats);
+
+/**
+ * What it took to load a module.
+ */
+struct hw_module_load_stats {
+    /** Class and instance the module was looked up with, inst may be NULL */
+    const char *class_id;
+    const char *inst;
+
+    /** File the module was loaded from and the variant it was found under */
+    const char *path;
+    const char *variant;
+
+    /** Whether symbols were bound lazily rather than at load time */
+    int lazy;
+
+    /** Size of the module file in bytes, -1 if unknown */
+    int64_t size;
+
+    /** Time spent in dlopen(), in dlsym() and in the whole lookup */
+    int64_t dlopen_ns;
+    int64_t dlsym_ns;
+    int64_t load_ns;
+};
+
+typedef void (*hw_module_load_stats_cb)(
+        const struct hw_module_load_stats *stats, void *cookie);
+
+/**
+ * Call 'cb' with the load statistics of every cached module. The strings in
+ * 'stats' are only valid during the call, and 'cb' must not look up
+ * modules.
+ */
+void hw_get_module_load_stats(hw_module_load_stats_cb cb, void *cookie);
+
+/**
+ * Write the load statistics of every cached module to 'fd' in a human
+ * readable form.
+ */
+void hw_dump_module_load_stats(int fd);
+
+/**
+ * A module loaded in the process.
+ */
+struct hw_loaded_module {
+    const struct hw_module_t *module;
+
+    /** File the module was loaded from and its dlopen handle */
+    const char *path;
+    void *handle;
+
+    /**
+     * Number of lookups that returned this module. Lookups are not
+     * released, so this is not a count of the current users.
+     */
+    uint32_t lookups;
+
+    /**
+     * Devices currently open on this module, only known when the property
+     * hal.track_devices was set to 1 when the module was loaded.
+     */
+    size_t num_devices;
+    struct hw_device_t **devices;
+};
+
+typedef void (*hw_loaded_module_cb)(const struct hw_loaded_module *module,
+        void *cookie);
+
+/**
+ * Call 'cb' for every module loaded by hw_get_module() and
+ * hw_get_module_by_class(). 'module' is only valid during the call, and
+ * 'cb' must neither look up modules nor open or close devices.
+ */
+void hw_get_loaded_modules(hw_loaded_module_cb cb, void *cookie);
+
+/**
+ * Unload the module cached for class 'class_id' and instance 'inst' so that
+ * the next lookup loads it again from its file. This is meant for test
+ * harnesses swapping a module under development: the module and every
+ * pointer obtained from it must no longer be used.
+ *
+ * Open devices are only detected when hal.track_devices is set (see
+ * struct hw_loaded_module), otherwise the caller must have closed them.
+ *
+ * @return: 0 == success, -ENOENT if the module is not cached, -EBUSY if
+ * devices are known to be still open on it.
+ */
+int hw_unload_module(const char *class_id, const char *inst);
+
+/**
+ * Unload the module for class 'class_id' and instance 'inst' as
+ * hw_unload_module() does, then load it again.
+ *
+ * @return: 0 == success, <0 == error and *module == NULL
+ */
+int hw_reload_module(const char *class_id, const char *inst,
+        const struct hw_module_t **module);
+
+/**
+ * Resolve and load the modules 'ids' (as passed to hw_get_module()) ahead of
+ * time, several at once on a small pool of threads. Later hw_get_module()
+ * calls for these ids are served from the module cache. The time taken by
+ * each module is logged.
+ *
+ * @return: 0 if every module was loaded, otherwise the error of one of the
+ * modules that failed. The other modules are loaded regardless.
+ */
+int hw_preload_modules(const char **ids, size_t n);
+
 __END_DECLS
 
 #endif  /* ANDROID_INCLUDE_HARDWARE_HARDWARE_H */
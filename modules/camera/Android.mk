@@ -27,11 +27,15 @@ LOCAL_SRC_FILES := \
 	CameraHAL.cpp \
 	Camera.cpp \
 	Metadata.cpp \
+	RequestQueue.cpp \
+	Settings.cpp \
 	Stream.cpp \
+	TestPattern.cpp \
 
 LOCAL_SHARED_LIBRARIES := \
 	libcamera_metadata \
 	libcutils \
+	libhardware \
 	liblog \
 	libsync \
 
@@ -16,7 +16,10 @@
 
 #include <cstdlib>
 #include <pthread.h>
+#include <unistd.h>
+#include <cutils/properties.h>
 #include <hardware/camera3.h>
+#include <hardware/gralloc.h>
 #include <sync/sync.h>
 #include <system/camera_metadata.h>
 #include <system/graphics.h>
@@ -35,6 +38,8 @@
 #include "Camera.h"
 
 #define CAMERA_SYNC_TIMEOUT 5000 // in msecs
+// Requests that may be in flight on each stream
+#define CAMERA_PIPELINE_DEPTH 4
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 
@@ -48,6 +53,25 @@ static int close_device(hw_device_t* dev)
     Camera* cam = static_cast<Camera*>(cam_dev->priv);
     return cam->close();
 }
+
+// Entry points of the capture pipeline threads
+static void *capture_thread(void *data)
+{
+    static_cast<Camera*>(data)->captureFrames();
+    return NULL;
+}
+
+static void *process_thread(void *data)
+{
+    static_cast<Camera*>(data)->processFrames();
+    return NULL;
+}
+
+static void *result_thread(void *data)
+{
+    static_cast<Camera*>(data)->deliverResults();
+    return NULL;
+}
 } // extern "C"
 
 Camera::Camera(int id)
@@ -57,10 +81,18 @@ Camera::Camera(int id)
     mCallbackOps(NULL),
     mStreams(NULL),
     mNumStreams(0),
-    mSettings(NULL)
+    mSettings(NULL),
+    mSettingsSize(0),
+    mSettingsGeneration(0),
+    mSettingsInPlace(false),
+    mPipelineRunning(false),
+    mNumInflight(0),
+    mGralloc(NULL)
 {
     pthread_mutex_init(&mMutex, NULL);
     pthread_mutex_init(&mStaticInfoMutex, NULL);
+    pthread_mutex_init(&mInflightMutex, NULL);
+    pthread_cond_init(&mInflightCond, NULL);
 
     memset(&mDevice, 0, sizeof(mDevice));
     mDevice.common.tag    = HARDWARE_DEVICE_TAG;
@@ -74,6 +106,8 @@ Camera::~Camera()
 {
     pthread_mutex_destroy(&mMutex);
     pthread_mutex_destroy(&mStaticInfoMutex);
+    pthread_mutex_destroy(&mInflightMutex);
+    pthread_cond_destroy(&mInflightCond);
 }
 
 int Camera::open(const hw_module_t *module, hw_device_t **device)
@@ -88,6 +122,26 @@ int Camera::open(const hw_module_t *module, hw_device_t **device)
     }
 
     // TODO: open camera dev nodes, etc
+    // Until then, output buffers are painted with a test pattern
+    const hw_module_t *gralloc;
+    int res = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &gralloc);
+    if (res) {
+        pthread_mutex_unlock(&mMutex);
+        ALOGE("%s:%d: Error! Cannot load gralloc module: %s(%d)",
+                __func__, mId, strerror(-res), res);
+        return res;
+    }
+    mGralloc = reinterpret_cast<const gralloc_module_t*>(gralloc);
+    char pattern[PROPERTY_VALUE_MAX];
+    property_get("camera.default.test_pattern", pattern, "");
+    if (pattern[0] != '\0')
+        mTestPattern.setPattern(atoi(pattern));
+
+    res = startPipeline();
+    if (res) {
+        pthread_mutex_unlock(&mMutex);
+        return res;
+    }
     mBusy = true;
     mDevice.common.module = const_cast<hw_module_t*>(module);
     *device = &mDevice.common;
@@ -125,6 +179,7 @@ int Camera::close()
     }
 
     // TODO: close camera dev nodes, etc
+    stopPipeline();
     mBusy = false;
 
     pthread_mutex_unlock(&mMutex);
@@ -211,7 +266,7 @@ camera_metadata_t *Camera::initStaticInfo()
     /* android.scaler */
     int32_t android_scaler_available_formats[] = {
             HAL_PIXEL_FORMAT_RAW_SENSOR,
-            HAL_PIXEL_FORMAT_BLOB,
+            // No BLOB: the test pattern is not encoded to JPEG
             HAL_PIXEL_FORMAT_RGBA_8888,
             HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
             // These are handled by YCbCr_420_888
@@ -312,6 +367,10 @@ int Camera::configureStreams(camera3_stream_configuration_t *stream_config)
         return -EINVAL;
     }
 
+    // The framework only reconfigures an idle device, but don't pull the
+    // streams from under requests still in the pipeline
+    waitIdle();
+
     // Create new stream array
     newStreams = new Stream*[stream_config->num_streams];
     ALOGV("%s:%d: Number of Streams: %d", __func__, mId,
@@ -349,6 +408,14 @@ int Camera::configureStreams(camera3_stream_configuration_t *stream_config)
     // Set up all streams (calculate usage/max_buffers for each)
     setupStreams(newStreams, stream_config->num_streams);
 
+    // A request has at most one buffer of each stream, and holds at least
+    // one of the CAMERA_PIPELINE_DEPTH buffers of a stream while in flight
+    if (mRequestPool.resize(CAMERA_PIPELINE_DEPTH * stream_config->num_streams,
+                stream_config->num_streams)) {
+        ALOGE("%s:%d: Unable to allocate capture requests", __func__, mId);
+        goto err_out;
+    }
+
     // Destroy all old streams and replace stream array with new one
     destroyStreams(mStreams, mNumStreams);
     mStreams = newStreams;
@@ -412,6 +479,11 @@ bool Camera::isValidStreamSet(Stream **streams, int count)
             inputs++;
         if (streams[i]->isOutputType())
             outputs++;
+        if (streams[i]->getFormat() == HAL_PIXEL_FORMAT_BLOB) {
+            ALOGE("%s:%d: BLOB (JPEG) streams are not supported",
+                    __func__, mId);
+            return false;
+        }
     }
     ALOGV("%s:%d: Configuring %d output streams and %d input streams",
             __func__, mId, outputs, inputs);
@@ -450,7 +522,7 @@ void Camera::setupStreams(Stream **streams, int count)
                      GRALLOC_USAGE_HW_CAMERA_READ;
 
         streams[i]->setUsage(usage);
-        streams[i]->setMaxBuffers(1);
+        streams[i]->setMaxBuffers(CAMERA_PIPELINE_DEPTH);
     }
 }
 
@@ -482,8 +554,6 @@ const camera_metadata_t* Camera::constructDefaultRequestSettings(int type)
 
 int Camera::processCaptureRequest(camera3_capture_request_t *request)
 {
-    camera3_capture_result result;
-
     ALOGV("%s:%d: request=%p", __func__, mId, request);
     CAMTRACE_CALL();
 
@@ -495,6 +565,13 @@ int Camera::processCaptureRequest(camera3_capture_request_t *request)
     ALOGV("%s:%d: Request Frame:%d Settings:%p", __func__, mId,
             request->frame_number, request->settings);
 
+    if (request->num_output_buffers <= 0 ||
+            request->num_output_buffers > mRequestPool.getMaxBuffers()) {
+        ALOGE("%s:%d: Invalid number of output buffers: %d", __func__, mId,
+                request->num_output_buffers);
+        return -EINVAL;
+    }
+
     // NULL indicates use last settings
     if (request->settings == NULL) {
         if (mSettings == NULL) {
@@ -502,8 +579,11 @@ int Camera::processCaptureRequest(camera3_capture_request_t *request)
                     __func__, mId, request->frame_number, request);
             return -EINVAL;
         }
+        mChangedTags.clear();
     } else {
-        setSettings(request->settings);
+        // Only the changed tags need to be validated and copied
+        mSettingsInPlace = diffSettings(mSettings, request->settings,
+                &mChangedTags);
     }
 
     if (request->input_buffer != NULL) {
@@ -525,85 +605,265 @@ int Camera::processCaptureRequest(camera3_capture_request_t *request)
         }
     }
 
-    if (request->num_output_buffers <= 0) {
-        ALOGE("%s:%d: Invalid number of output buffers: %d", __func__, mId,
-                request->num_output_buffers);
-        return -EINVAL;
-    }
-    result.num_output_buffers = request->num_output_buffers;
-    result.output_buffers = new camera3_stream_buffer_t[result.num_output_buffers];
+    // Only a fully validated request may replace the last settings
+    if (request->settings != NULL && setSettings(request->settings))
+        return -ENOMEM;
+
+    pthread_mutex_lock(&mInflightMutex);
+    mNumInflight++;
+    pthread_mutex_unlock(&mInflightMutex);
+
+    // Block while the pipeline is full
     for (unsigned int i = 0; i < request->num_output_buffers; i++) {
-        int res = processCaptureBuffer(&request->output_buffers[i],
-                const_cast<camera3_stream_buffer_t*>(&result.output_buffers[i]));
-        if (res)
-            goto err_out;
+        const camera3_stream_t *astream = request->output_buffers[i].stream;
+        reinterpret_cast<Stream*>(astream->priv)->acquireInflightBuffer();
     }
 
-    result.frame_number = request->frame_number;
+    // The framework's request is only valid during this call, the pipeline
+    // works on a copy in a pooled request
+    CaptureRequest *r = mRequestPool.get();
+    r->mFrameNumber = request->frame_number;
+    r->mNumBuffers = request->num_output_buffers;
+    r->mTimestamp = 0;
+    memcpy(r->mBuffers, request->output_buffers,
+            r->mNumBuffers * sizeof(*r->mBuffers));
     // TODO: return actual captured/reprocessed settings
-    result.result = request->settings;
-    // TODO: asynchronously return results
-    notifyShutter(request->frame_number, 0);
-    mCallbackOps->process_capture_result(mCallbackOps, &result);
+    if (r->mSettings == NULL || r->mSettingsGeneration != mSettingsGeneration) {
+        camera_metadata_t *settings = copySettings(r->mSettings,
+                &r->mSettingsSize, mSettings);
+        if (settings == NULL) {
+            releaseRequest(r);
+            return -ENOMEM;
+        }
+        r->mSettings = settings;
+        r->mSettingsGeneration = mSettingsGeneration;
+    }
+
+    mCaptureQueue.push(r);
+    return 0;
+}
 
+int Camera::startPipeline()
+{
+    mCaptureQueue.reopen();
+    mProcessQueue.reopen();
+    mResultQueue.reopen();
+
+    int res = pthread_create(&mCaptureThread, NULL, capture_thread, this);
+    if (res)
+        goto err_capture;
+    res = pthread_create(&mProcessThread, NULL, process_thread, this);
+    if (res)
+        goto err_process;
+    res = pthread_create(&mResultThread, NULL, result_thread, this);
+    if (res)
+        goto err_result;
+    mPipelineRunning = true;
     return 0;
 
-err_out:
-    delete [] result.output_buffers;
-    // TODO: this should probably be a total device failure; transient for now
-    return -EINVAL;
+err_result:
+    mProcessQueue.close();
+    pthread_join(mProcessThread, NULL);
+err_process:
+    mCaptureQueue.close();
+    pthread_join(mCaptureThread, NULL);
+err_capture:
+    ALOGE("%s:%d: Unable to start capture pipeline: %s(%d)", __func__, mId,
+            strerror(res), res);
+    return -res;
+}
+
+void Camera::stopPipeline()
+{
+    if (!mPipelineRunning)
+        return;
+    // Each stage completes the requests queued before it is closed, and
+    // passes them on to the next
+    mCaptureQueue.close();
+    pthread_join(mCaptureThread, NULL);
+    mProcessQueue.close();
+    pthread_join(mProcessThread, NULL);
+    mResultQueue.close();
+    pthread_join(mResultThread, NULL);
+    mPipelineRunning = false;
+}
+
+void Camera::waitIdle()
+{
+    pthread_mutex_lock(&mInflightMutex);
+    while (mNumInflight > 0)
+        pthread_cond_wait(&mInflightCond, &mInflightMutex);
+    pthread_mutex_unlock(&mInflightMutex);
 }
 
-void Camera::setSettings(const camera_metadata_t *new_settings)
+void Camera::captureFrames()
 {
-    if (mSettings != NULL) {
-        free_camera_metadata(mSettings);
+    CaptureRequest *r;
+    struct timespec ts;
+
+    while ((r = mCaptureQueue.pop()) != NULL) {
+        CAMTRACE_NAME("captureFrame");
+        for (unsigned int i = 0; i < r->mNumBuffers; i++)
+            waitAcquireFence(&r->mBuffers[i]);
+
+        // TODO: trigger the exposure on the sensor and use its timestamp
+        if (clock_gettime(CLOCK_BOOTTIME, &ts) == 0)
+            r->mTimestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        notifyShutter(r->mFrameNumber, r->mTimestamp);
+        mProcessQueue.push(r);
+    }
+}
+
+void Camera::processFrames()
+{
+    CaptureRequest *r;
+
+    while ((r = mProcessQueue.pop()) != NULL) {
+        CAMTRACE_NAME("processFrame");
+        for (unsigned int i = 0; i < r->mNumBuffers; i++) {
+            camera3_stream_buffer_t *buffer = &r->mBuffers[i];
+            if (buffer->status == CAMERA3_BUFFER_STATUS_OK &&
+                    processCaptureBuffer(buffer, r->mFrameNumber))
+                buffer->status = CAMERA3_BUFFER_STATUS_ERROR;
+        }
+        mResultQueue.push(r);
+    }
+}
+
+void Camera::deliverResults()
+{
+    CaptureRequest *r;
+    camera3_capture_result result;
+
+    while ((r = mResultQueue.pop()) != NULL) {
+        CAMTRACE_NAME("deliverResult");
+        // The framework must hear of a dropped buffer before its result
+        for (unsigned int i = 0; i < r->mNumBuffers; i++) {
+            if (r->mBuffers[i].status == CAMERA3_BUFFER_STATUS_ERROR)
+                notifyBufferError(r->mFrameNumber, r->mBuffers[i].stream);
+        }
+        result.frame_number = r->mFrameNumber;
+        result.result = r->mSettings;
+        result.num_output_buffers = r->mNumBuffers;
+        result.output_buffers = r->mBuffers;
+        mCallbackOps->process_capture_result(mCallbackOps, &result);
+        releaseRequest(r);
+    }
+}
+
+void Camera::releaseRequest(CaptureRequest *r)
+{
+    for (unsigned int i = 0; i < r->mNumBuffers; i++) {
+        Stream *stream = reinterpret_cast<Stream*>(r->mBuffers[i].stream->priv);
+        stream->releaseInflightBuffer();
+    }
+    mRequestPool.put(r);
+
+    pthread_mutex_lock(&mInflightMutex);
+    mNumInflight--;
+    pthread_cond_broadcast(&mInflightCond);
+    pthread_mutex_unlock(&mInflightMutex);
+}
+
+int Camera::setSettings(const camera_metadata_t *new_settings)
+{
+    if (new_settings == NULL) {
+        free(mSettings);
         mSettings = NULL;
+        mSettingsSize = 0;
+        mSettingsGeneration++;
+        return 0;
     }
 
-    if (new_settings != NULL)
-        mSettings = clone_camera_metadata(new_settings);
+    // Resent settings
+    if (mSettings != NULL && mChangedTags.empty())
+        return 0;
+
+    mSettingsGeneration++;
+    // Only values changed, update the changed entries
+    if (mSettings != NULL && mSettingsInPlace) {
+        size_t count = get_camera_metadata_entry_count(new_settings);
+        size_t i;
+        for (i = 0; i < count; i++) {
+            camera_metadata_ro_entry_t e;
+            get_camera_metadata_ro_entry(new_settings, i, &e);
+            if (mChangedTags.contains(e.tag) &&
+                    update_camera_metadata_entry(mSettings, i, e.data.u8,
+                        e.count, NULL))
+                break;
+        }
+        if (i == count)
+            return 0;
+    }
+
+    // Otherwise copy them whole, over the previous ones when they fit
+    camera_metadata_t *settings = copySettings(mSettings, &mSettingsSize,
+            new_settings);
+    if (settings == NULL)
+        return -ENOMEM;
+    mSettings = settings;
+    return 0;
 }
 
-bool Camera::isValidCaptureSettings(const camera_metadata_t* /*settings*/)
+bool Camera::isValidCaptureSettings(const camera_metadata_t *settings)
 {
-    // TODO: reject settings that cannot be captured
-    return true;
+    // Unchanged settings were checked when they were set
+    if (settings == NULL)
+        return true;
+
+    pthread_mutex_lock(&mStaticInfoMutex);
+    if (mStaticInfo == NULL) {
+        mStaticInfo = initStaticInfo();
+    }
+    pthread_mutex_unlock(&mStaticInfoMutex);
+
+    // TODO: reject settings the sensor cannot capture, beyond the static
+    // characteristics
+    return validateSettings(mStaticInfo, settings, mChangedTags);
 }
 
 bool Camera::isValidReprocessSettings(const camera_metadata_t* /*settings*/)
 {
-    // TODO: reject settings that cannot be reprocessed
-    // input buffers unimplemented, use this to reject reprocessing requests
+    // The capture pipeline only paints test patterns into output buffers,
+    // nothing reads input buffers: reject all reprocessing requests rather
+    // than return results that ignore their input
     ALOGE("%s:%d: Input buffer reprocessing not implemented", __func__, mId);
     return false;
 }
 
-int Camera::processCaptureBuffer(const camera3_stream_buffer_t *in,
-        camera3_stream_buffer_t *out)
+int Camera::waitAcquireFence(camera3_stream_buffer_t *buffer)
 {
-    if (in->acquire_fence != -1) {
-        int res = sync_wait(in->acquire_fence, CAMERA_SYNC_TIMEOUT);
+    buffer->status = CAMERA3_BUFFER_STATUS_OK;
+    buffer->release_fence = -1;
+    if (buffer->acquire_fence == -1)
+        return 0;
+
+    int res = sync_wait(buffer->acquire_fence, CAMERA_SYNC_TIMEOUT);
+    if (res) {
+        res = -errno;
         if (res == -ETIME) {
             ALOGE("%s:%d: Timeout waiting on buffer acquire fence",
                     __func__, mId);
-            return res;
-        } else if (res) {
+        } else {
             ALOGE("%s:%d: Error waiting on buffer acquire fence: %s(%d)",
                     __func__, mId, strerror(-res), res);
-            return res;
         }
+        // Let the framework wait on the fence before reusing the buffer
+        buffer->status = CAMERA3_BUFFER_STATUS_ERROR;
+        buffer->release_fence = buffer->acquire_fence;
+    } else {
+        ::close(buffer->acquire_fence);
     }
+    buffer->acquire_fence = -1;
+    return res;
+}
 
-    out->stream = in->stream;
-    out->buffer = in->buffer;
-    out->status = CAMERA3_BUFFER_STATUS_OK;
+int Camera::processCaptureBuffer(camera3_stream_buffer_t *buffer,
+        uint32_t frame_number)
+{
     // TODO: use driver-backed release fences
-    out->acquire_fence = -1;
-    out->release_fence = -1;
-
-    // TODO: lock and software-paint buffer
-    return 0;
+    return mTestPattern.render(mGralloc, buffer->stream, buffer->buffer,
+            frame_number);
 }
 
 void Camera::notifyShutter(uint32_t frame_number, uint64_t timestamp)
@@ -631,6 +891,18 @@ void Camera::notifyShutter(uint32_t frame_number, uint64_t timestamp)
     mCallbackOps->notify(mCallbackOps, &m);
 }
 
+void Camera::notifyBufferError(uint32_t frame_number,
+        camera3_stream_t *stream)
+{
+    camera3_notify_msg_t m;
+    memset(&m, 0, sizeof(m));
+    m.type = CAMERA3_MSG_ERROR;
+    m.message.error.frame_number = frame_number;
+    m.message.error.error_stream = stream;
+    m.message.error.error_code = CAMERA3_MSG_ERROR_BUFFER;
+    mCallbackOps->notify(mCallbackOps, &m);
+}
+
 void Camera::getMetadataVendorTagOps(vendor_tag_query_ops_t *ops)
 {
     ALOGV("%s:%d: ops=%p", __func__, mId, ops);
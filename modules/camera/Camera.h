@@ -20,8 +20,12 @@
 #include <pthread.h>
 #include <hardware/hardware.h>
 #include <hardware/camera3.h>
+#include <hardware/gralloc.h>
 #include "Metadata.h"
+#include "RequestQueue.h"
+#include "Settings.h"
 #include "Stream.h"
+#include "TestPattern.h"
 
 namespace default_camera_hal {
 // Camera represents a physical camera on a device.
@@ -49,6 +53,15 @@ class Camera {
         void getMetadataVendorTagOps(vendor_tag_query_ops_t *ops);
         void dump(int fd);
 
+        // Capture pipeline stages, each run by its own thread while the
+        // device is open. Requests go through them in order:
+        // Wait for the buffers to be free, expose and notify the shutter
+        void captureFrames();
+        // Fill the output buffers
+        void processFrames();
+        // Return the buffers and result metadata to the framework
+        void deliverResults();
+
         // Camera device handle returned to framework for use
         camera3_device_t mDevice;
 
@@ -63,17 +76,33 @@ class Camera {
         bool isValidStreamSet(Stream **array, int count);
         // Calculate usage and max_bufs of each stream
         void setupStreams(Stream **array, int count);
-        // Copy new settings for re-use and clean up old settings.
-        void setSettings(const camera_metadata_t *new_settings);
-        // Verify settings are valid for a capture
+        // Copy new settings for re-use, over the old settings when they fit.
+        // Only the entries in mChangedTags are copied when mSettingsInPlace.
+        int setSettings(const camera_metadata_t *new_settings);
+        // Verify the entries of settings in mChangedTags are valid for a
+        // capture
         bool isValidCaptureSettings(const camera_metadata_t *settings);
         // Verify settings are valid for reprocessing an input buffer
         bool isValidReprocessSettings(const camera_metadata_t *settings);
-        // Process an output buffer
-        int processCaptureBuffer(const camera3_stream_buffer_t *in,
-                camera3_stream_buffer_t *out);
+        // Start the threads of the capture pipeline
+        int startPipeline();
+        // Complete the requests in flight and stop the pipeline threads
+        void stopPipeline();
+        // Wait until all requests in flight are completed
+        void waitIdle();
+        // Wait on the acquire fence of an output buffer
+        int waitAcquireFence(camera3_stream_buffer_t *buffer);
+        // Process an output buffer of frame 'frame_number'
+        int processCaptureBuffer(camera3_stream_buffer_t *buffer,
+                uint32_t frame_number);
+        // Free a completed request
+        void releaseRequest(CaptureRequest *r);
         // Send a shutter notify message with start of exposure time
         void notifyShutter(uint32_t frame_number, uint64_t timestamp);
+        // Send a buffer error notify message for an output buffer of frame
+        // 'frame_number' that was not filled
+        void notifyBufferError(uint32_t frame_number,
+                camera3_stream_t *stream);
 
         // Identifier used by framework to distinguish cameras
         const int mId;
@@ -100,6 +129,38 @@ class Camera {
         Metadata *mTemplates[CAMERA3_TEMPLATE_COUNT];
         // Most recent request settings seen, memoized to be reused
         camera_metadata_t *mSettings;
+        // Size of the buffer holding mSettings, reused by the next settings
+        size_t mSettingsSize;
+        // Incremented every time mSettings changes
+        uint32_t mSettingsGeneration;
+        // Tags of the request being processed that differ from mSettings
+        TagSet mChangedTags;
+        // The request settings only differ from mSettings by values, and can
+        // be copied entry by entry
+        bool mSettingsInPlace;
+        // Requests of the capture pipeline, sized for the configured streams
+        RequestPool mRequestPool;
+        // Requests waiting for each stage of the capture pipeline
+        RequestQueue mCaptureQueue;
+        RequestQueue mProcessQueue;
+        RequestQueue mResultQueue;
+        // Threads running the capture pipeline stages
+        pthread_t mCaptureThread;
+        pthread_t mProcessThread;
+        pthread_t mResultThread;
+        // The pipeline threads are running
+        bool mPipelineRunning;
+        // Number of requests in flight
+        int mNumInflight;
+        // Lock protecting mNumInflight, and condition signaled when a
+        // request completes
+        pthread_mutex_t mInflightMutex;
+        pthread_cond_t mInflightCond;
+        // Gralloc module used to lock output buffers
+        const gralloc_module_t *mGralloc;
+        // Synthetic sensor painting the output buffers, only used by the
+        // processing thread
+        TestPattern mTestPattern;
 };
 } // namespace default_camera_hal
 
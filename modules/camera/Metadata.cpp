@@ -14,7 +14,9 @@
  * limitations under the License.
  */
 
+#include <cstdlib>
 #include <pthread.h>
+#include <string.h>
 #include <system/camera_metadata.h>
 
 //#define LOG_NDEBUG 0
@@ -29,13 +31,25 @@
 
 namespace default_camera_hal {
 
+// Bytes taken by 'count' values of type 'type' in the data arena, which keeps
+// 64-bit values aligned
+static inline size_t arenaSize(int type, int count)
+{
+    return (count * camera_metadata_type_size[type] + 7) & ~size_t(7);
+}
+
 Metadata::Metadata()
-  : mHead(NULL),
-    mTail(NULL),
+  : mEntries(NULL),
+    mEntryCapacity(0),
+    mData(NULL),
+    mDataSize(0),
+    mDataCapacity(0),
+    mDataUsed(0),
     mEntryCount(0),
     mDataCount(0),
     mGenerated(NULL),
-    mDirty(true)
+    mDirty(true),
+    mLayoutDirty(true)
 {
     // NULL (default) pthread mutex attributes
     pthread_mutex_init(&mMutex, NULL);
@@ -43,13 +57,8 @@ Metadata::Metadata()
 
 Metadata::~Metadata()
 {
-    Entry *current = mHead;
-
-    while (current != NULL) {
-        Entry *tmp = current;
-        current = current->mNext;
-        delete tmp;
-    }
+    free(mEntries);
+    free(mData);
 
     if (mGenerated != NULL)
         free_camera_metadata(mGenerated);
@@ -58,12 +67,17 @@ Metadata::~Metadata()
 }
 
 Metadata::Metadata(uint8_t mode, uint8_t intent)
-  : mHead(NULL),
-    mTail(NULL),
+  : mEntries(NULL),
+    mEntryCapacity(0),
+    mData(NULL),
+    mDataSize(0),
+    mDataCapacity(0),
+    mDataUsed(0),
     mEntryCount(0),
     mDataCount(0),
     mGenerated(NULL),
-    mDirty(true)
+    mDirty(true),
+    mLayoutDirty(true)
 {
     pthread_mutex_init(&mMutex, NULL);
 
@@ -148,20 +162,124 @@ bool Metadata::validate(uint32_t tag, int tag_type, int count)
 int Metadata::add(uint32_t tag, int count, void *tag_data)
 {
     int tag_type = get_camera_metadata_tag_type(tag);
-    size_t type_sz = camera_metadata_type_size[tag_type];
-
-    // Allocate array to hold new metadata
-    void *data = malloc(count * type_sz);
-    if (data == NULL)
-        return -ENOMEM;
-    memcpy(data, tag_data, count * type_sz);
+    size_t size = count * camera_metadata_type_size[tag_type];
+    int res = 0;
 
     pthread_mutex_lock(&mMutex);
-    mEntryCount++;
+    size_t i = lowerBound(tag);
+    Entry *e = i < mEntryCount && mEntries[i].mTag == tag ? &mEntries[i] : NULL;
+    if (e != NULL && e->mCount == count) {
+        // Same size, overwrite the values
+        memcpy(mData + e->mOffset, tag_data, size);
+        e->mDirty = true;
+        mDirty = true;
+        goto out;
+    }
+
+    size_t offset;
+    res = allocData(size, &offset);
+    if (res)
+        goto out;
+    memcpy(mData + offset, tag_data, size);
+
+    if (e != NULL) {
+        // Resized, the old values are left in the arena
+        mDataUsed -= arenaSize(tag_type, e->mCount);
+        mDataCount -= calculate_camera_metadata_entry_data_size(tag_type,
+                e->mCount);
+    } else {
+        if (mEntryCount == mEntryCapacity) {
+            size_t capacity = mEntryCapacity ? 2 * mEntryCapacity : 16;
+            Entry *entries = static_cast<Entry*>(realloc(mEntries,
+                    capacity * sizeof(*entries)));
+            if (entries == NULL) {
+                mDataUsed -= arenaSize(tag_type, count);
+                res = -ENOMEM;
+                goto out;
+            }
+            mEntries = entries;
+            mEntryCapacity = capacity;
+        }
+        e = &mEntries[i];
+        memmove(e + 1, e, (mEntryCount - i) * sizeof(*e));
+        e->mTag = tag;
+        e->mType = tag_type;
+        mEntryCount++;
+    }
+    e->mCount = count;
+    e->mOffset = offset;
+    e->mDirty = true;
     mDataCount += calculate_camera_metadata_entry_data_size(tag_type, count);
-    push(new Entry(tag, data, count));
     mDirty = true;
+    mLayoutDirty = true;
+
+out:
     pthread_mutex_unlock(&mMutex);
+    return res;
+}
+
+int Metadata::find(uint32_t tag, camera_metadata_ro_entry_t *entry)
+{
+    int res = -ENOENT;
+
+    pthread_mutex_lock(&mMutex);
+    size_t i = lowerBound(tag);
+    if (i < mEntryCount && mEntries[i].mTag == tag) {
+        const Entry &e = mEntries[i];
+        entry->index = i;
+        entry->tag = e.mTag;
+        entry->type = e.mType;
+        entry->count = e.mCount;
+        entry->data.u8 = mData + e.mOffset;
+        res = 0;
+    }
+    pthread_mutex_unlock(&mMutex);
+    return res;
+}
+
+size_t Metadata::lowerBound(uint32_t tag) const
+{
+    size_t lo = 0, hi = mEntryCount;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (mEntries[mid].mTag < tag)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int Metadata::allocData(size_t size, size_t *offset)
+{
+    size = (size + 7) & ~size_t(7);
+
+    if (mDataSize + size > mDataCapacity) {
+        size_t capacity = mDataCapacity ? mDataCapacity : 256;
+        while (capacity < mDataUsed + size)
+            capacity *= 2;
+        uint8_t *data = static_cast<uint8_t*>(malloc(capacity));
+        if (data == NULL)
+            return -ENOMEM;
+        // Move the live values, dropping the replaced ones
+        size_t used = 0;
+        for (size_t i = 0; i < mEntryCount; i++) {
+            Entry &e = mEntries[i];
+            memcpy(data + used, mData + e.mOffset,
+                    e.mCount * camera_metadata_type_size[e.mType]);
+            e.mOffset = used;
+            used += arenaSize(e.mType, e.mCount);
+        }
+        free(mData);
+        mData = data;
+        mDataSize = used;
+        mDataCapacity = capacity;
+        mDataUsed = used;
+    }
+
+    *offset = mDataSize;
+    mDataSize += size;
+    mDataUsed += size;
     return 0;
 }
 
@@ -173,6 +291,34 @@ camera_metadata_t* Metadata::generate()
         ALOGV("%s: Reusing generated metadata at %p", __func__, mGenerated);
         goto out;
     }
+    // Only values changed, update them in place. The generated entries are
+    // in the same order as mEntries.
+    if (!mLayoutDirty && mGenerated != NULL) {
+        ALOGV("%s: Updating generated metadata at %p", __func__, mGenerated);
+        for (size_t i = 0; i < mEntryCount; i++) {
+            Entry &e = mEntries[i];
+            if (!e.mDirty)
+                continue;
+            if (update_camera_metadata_entry(mGenerated, i, mData + e.mOffset,
+                        e.mCount, NULL) != 0) {
+                ALOGE("%s: Failed to update camera metadata", __func__);
+                regenerate();
+                goto out;
+            }
+            e.mDirty = false;
+        }
+        mDirty = false;
+        goto out;
+    }
+    regenerate();
+
+out:
+    pthread_mutex_unlock(&mMutex);
+    return mGenerated;
+}
+
+void Metadata::regenerate()
+{
     // Destroy old metadata
     if (mGenerated != NULL) {
         ALOGV("%s: Freeing generated metadata at %p", __func__, mGenerated);
@@ -180,67 +326,31 @@ camera_metadata_t* Metadata::generate()
         mGenerated = NULL;
     }
     // Generate new metadata structure
-    ALOGV("%s: Generating new camera metadata structure, Entries:%d Data:%d",
+    ALOGV("%s: Generating new camera metadata structure, Entries:%zu Data:%zu",
             __func__, mEntryCount, mDataCount);
     mGenerated = allocate_camera_metadata(mEntryCount, mDataCount);
     if (mGenerated == NULL) {
-        ALOGE("%s: Failed to allocate metadata (%d entries %d data)",
+        ALOGE("%s: Failed to allocate metadata (%zu entries %zu data)",
                 __func__, mEntryCount, mDataCount);
-        goto out;
+        return;
     }
-    // Walk list of entries adding each one to newly allocated metadata
-    for (Entry *current = mHead; current != NULL; current = current->mNext) {
-        int res = add_camera_metadata_entry(mGenerated, current->mTag,
-                current->mData, current->mCount);
+    // Entries are added in tag order, sorting only flags the metadata as
+    // sorted for binary searches
+    for (size_t i = 0; i < mEntryCount; i++) {
+        Entry &e = mEntries[i];
+        int res = add_camera_metadata_entry(mGenerated, e.mTag,
+                mData + e.mOffset, e.mCount);
         if (res != 0) {
             ALOGE("%s: Failed to add camera metadata: %d", __func__, res);
             free_camera_metadata(mGenerated);
             mGenerated = NULL;
-            goto out;
+            return;
         }
+        e.mDirty = false;
     }
-
-out:
-    pthread_mutex_unlock(&mMutex);
-    return mGenerated;
-}
-
-Metadata::Entry::Entry(uint32_t tag, void *data, int count)
-  : mNext(NULL),
-    mPrev(NULL),
-    mTag(tag),
-    mData(data),
-    mCount(count)
-{
-}
-
-void Metadata::push(Entry *e)
-{
-    if (mHead == NULL) {
-        mHead = mTail = e;
-    } else {
-        mTail->insertAfter(e);
-        mTail = e;
-    }
-}
-
-Metadata::Entry::~Entry()
-{
-    if (mNext != NULL)
-        mNext->mPrev = mPrev;
-    if (mPrev != NULL)
-        mPrev->mNext = mNext;
-}
-
-void Metadata::Entry::insertAfter(Entry *e)
-{
-    if (e == NULL)
-        return;
-    if (mNext != NULL)
-        mNext->mPrev = e;
-    e->mNext = mNext;
-    e->mPrev = this;
-    mNext = e;
+    sort_camera_metadata(mGenerated);
+    mDirty = false;
+    mLayoutDirty = false;
 }
 
 } // namespace default_camera_hal
@@ -31,7 +31,7 @@ class Metadata {
         // Constructor used for request metadata templates
         Metadata(uint8_t mode, uint8_t intent);
 
-        // Parse and add an entry
+        // Parse and add an entry, or replace the values of an existing one
         int addUInt8(uint32_t tag, int count, uint8_t *data);
         int addInt32(uint32_t tag, int count, int32_t *data);
         int addFloat(uint32_t tag, int count, float *data);
@@ -39,6 +39,8 @@ class Metadata {
         int addDouble(uint32_t tag, int count, double *data);
         int addRational(uint32_t tag, int count,
                 camera_metadata_rational_t *data);
+        // Find the entry of a tag, its data is valid until the next add
+        int find(uint32_t tag, camera_metadata_ro_entry_t *entry);
         // Generate a camera_metadata structure and fill it with internal data
         camera_metadata_t *generate();
 
@@ -47,30 +49,41 @@ class Metadata {
         bool validate(uint32_t tag, int tag_type, int count);
         // Add a verified tag with data to this Metadata structure
         int add(uint32_t tag, int count, void *tag_data);
+        // Index of the entry of a tag, or where to insert it
+        size_t lowerBound(uint32_t tag) const;
+        // Reserve 'size' bytes of entry data, returns their offset in mData
+        int allocData(size_t size, size_t *offset);
+        // Rebuild mGenerated from all the entries
+        void regenerate();
 
-        class Entry {
-            public:
-                Entry(uint32_t tag, void *data, int count);
-                ~Entry();
-                Entry *mNext;
-                Entry *mPrev;
-                const uint32_t mTag;
-                const void *mData;
-                const int mCount;
-                void insertAfter(Entry *e);
+        struct Entry {
+            uint32_t mTag;
+            int mType;
+            int mCount;
+            // Offset of the values in mData
+            size_t mOffset;
+            // Values changed since mGenerated was generated
+            bool mDirty;
         };
-        // List ends
-        Entry *mHead;
-        Entry *mTail;
-        // Append entry to list
-        void push(Entry *e);
+        // Entries, sorted by tag
+        Entry *mEntries;
+        size_t mEntryCapacity;
+        // Values of the entries, replaced values are reclaimed when the
+        // arena is full
+        uint8_t *mData;
+        size_t mDataSize;
+        size_t mDataCapacity;
+        size_t mDataUsed;
         // Total of entries and entry data size
-        int mEntryCount;
-        int mDataCount;
+        size_t mEntryCount;
+        size_t mDataCount;
         // Save generated metadata, invalidated on update
         camera_metadata_t *mGenerated;
         // Flag to force metadata regeneration
         bool mDirty;
+        // Entries were added or changed size since mGenerated was generated,
+        // otherwise only the dirty entries need to be updated
+        bool mLayoutDirty;
         // Lock protecting the Metadata object for modifications
         pthread_mutex_t mMutex;
 };
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdlib>
+#include <errno.h>
+#include <pthread.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "RequestQueue"
+#include <cutils/log.h>
+
+#include "RequestQueue.h"
+
+namespace default_camera_hal {
+
+camera_metadata_t *copySettings(camera_metadata_t *dst, size_t *dst_size,
+        const camera_metadata_t *src)
+{
+    size_t size = get_camera_metadata_compact_size(src);
+    if (size > *dst_size) {
+        void *buf = realloc(dst, size);
+        if (buf == NULL) {
+            ALOGE("%s: Failed to allocate %zu bytes of settings", __func__,
+                    size);
+            return NULL;
+        }
+        dst = static_cast<camera_metadata_t*>(buf);
+        *dst_size = size;
+    }
+    return copy_camera_metadata(dst, *dst_size, src);
+}
+
+RequestQueue::RequestQueue()
+  : mHead(NULL),
+    mTail(NULL),
+    mClosed(false)
+{
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mCond, NULL);
+}
+
+RequestQueue::~RequestQueue()
+{
+    if (mHead != NULL)
+        ALOGE("%s: Destroying non-empty request queue", __func__);
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mMutex);
+}
+
+void RequestQueue::push(CaptureRequest *r)
+{
+    r->mNext = NULL;
+    pthread_mutex_lock(&mMutex);
+    if (mTail == NULL)
+        mHead = r;
+    else
+        mTail->mNext = r;
+    mTail = r;
+    pthread_cond_signal(&mCond);
+    pthread_mutex_unlock(&mMutex);
+}
+
+CaptureRequest *RequestQueue::pop()
+{
+    pthread_mutex_lock(&mMutex);
+    while (mHead == NULL && !mClosed)
+        pthread_cond_wait(&mCond, &mMutex);
+    CaptureRequest *r = mHead;
+    if (r != NULL) {
+        mHead = r->mNext;
+        if (mHead == NULL)
+            mTail = NULL;
+    }
+    pthread_mutex_unlock(&mMutex);
+    return r;
+}
+
+void RequestQueue::close()
+{
+    pthread_mutex_lock(&mMutex);
+    mClosed = true;
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mMutex);
+}
+
+void RequestQueue::reopen()
+{
+    pthread_mutex_lock(&mMutex);
+    mClosed = false;
+    pthread_mutex_unlock(&mMutex);
+}
+
+RequestPool::RequestPool()
+  : mRequests(NULL),
+    mBuffers(NULL),
+    mNumRequests(0),
+    mMaxBuffers(0),
+    mFree(NULL)
+{
+    pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mCond, NULL);
+}
+
+RequestPool::~RequestPool()
+{
+    clear();
+    pthread_cond_destroy(&mCond);
+    pthread_mutex_destroy(&mMutex);
+}
+
+void RequestPool::clear()
+{
+    for (unsigned int i = 0; i < mNumRequests; i++)
+        free(mRequests[i].mSettings);
+    delete [] mRequests;
+    delete [] mBuffers;
+    mRequests = NULL;
+    mBuffers = NULL;
+    mNumRequests = 0;
+    mMaxBuffers = 0;
+    mFree = NULL;
+}
+
+int RequestPool::resize(unsigned int requests, unsigned int buffers)
+{
+    pthread_mutex_lock(&mMutex);
+    clear();
+    if (requests == 0 || buffers == 0) {
+        pthread_mutex_unlock(&mMutex);
+        return 0;
+    }
+    mRequests = new CaptureRequest[requests];
+    mBuffers = new camera3_stream_buffer_t[requests * buffers];
+    if (mRequests == NULL || mBuffers == NULL) {
+        clear();
+        pthread_mutex_unlock(&mMutex);
+        return -ENOMEM;
+    }
+    mNumRequests = requests;
+    mMaxBuffers = buffers;
+    for (unsigned int i = 0; i < requests; i++) {
+        CaptureRequest *r = &mRequests[i];
+        r->mSettings = NULL;
+        r->mSettingsSize = 0;
+        r->mSettingsGeneration = 0;
+        r->mBuffers = &mBuffers[i * buffers];
+        r->mNumBuffers = 0;
+        r->mNext = mFree;
+        mFree = r;
+    }
+    pthread_mutex_unlock(&mMutex);
+    return 0;
+}
+
+CaptureRequest *RequestPool::get()
+{
+    pthread_mutex_lock(&mMutex);
+    while (mFree == NULL && mNumRequests > 0)
+        pthread_cond_wait(&mCond, &mMutex);
+    CaptureRequest *r = mFree;
+    if (r != NULL)
+        mFree = r->mNext;
+    pthread_mutex_unlock(&mMutex);
+    return r;
+}
+
+void RequestPool::put(CaptureRequest *r)
+{
+    pthread_mutex_lock(&mMutex);
+    r->mNext = mFree;
+    mFree = r;
+    pthread_cond_signal(&mCond);
+    pthread_mutex_unlock(&mMutex);
+}
+
+} // namespace default_camera_hal
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef REQUEST_QUEUE_H_
+#define REQUEST_QUEUE_H_
+
+#include <pthread.h>
+#include <hardware/camera3.h>
+#include <system/camera_metadata.h>
+
+namespace default_camera_hal {
+// CaptureRequest holds a capture request while it goes through the capture
+// pipeline, and then its results.
+struct CaptureRequest {
+    // Frame number given by the framework
+    uint32_t mFrameNumber;
+    // Settings of this capture, in a buffer owned by the request and
+    // reused by the following requests
+    camera_metadata_t *mSettings;
+    // Size of the buffer holding mSettings
+    size_t mSettingsSize;
+    // Generation of the camera settings copied in mSettings
+    uint32_t mSettingsGeneration;
+    // Copy of the framework's output buffers, returned as the results
+    camera3_stream_buffer_t *mBuffers;
+    // Number of buffers in mBuffers
+    uint32_t mNumBuffers;
+    // Start of exposure, in CLOCK_BOOTTIME nanoseconds
+    uint64_t mTimestamp;
+    // Next request in a RequestQueue
+    CaptureRequest *mNext;
+};
+
+// Copy 'src' into the buffer 'dst' of '*dst_size' bytes, which is reallocated
+// only when too small. Returns the copy, at the start of the buffer, or NULL
+// if the buffer could not be grown.
+camera_metadata_t *copySettings(camera_metadata_t *dst, size_t *dst_size,
+        const camera_metadata_t *src);
+
+// RequestQueue passes capture requests, in order, from one stage of the
+// capture pipeline to the thread of the next one.
+class RequestQueue {
+    public:
+        RequestQueue();
+        ~RequestQueue();
+
+        // Append a request to the queue
+        void push(CaptureRequest *r);
+        // Wait for a request and remove it from the queue. Returns NULL once
+        // the queue is closed and empty.
+        CaptureRequest *pop();
+        // Wake up the consumer once the queued requests are popped
+        void close();
+        // Accept requests again after close()
+        void reopen();
+
+    private:
+        // Oldest and newest request in the queue
+        CaptureRequest *mHead;
+        CaptureRequest *mTail;
+        // No more requests will be pushed
+        bool mClosed;
+        // Lock protecting the queue, and condition signaled on push/close
+        pthread_mutex_t mMutex;
+        pthread_cond_t mCond;
+};
+
+// RequestPool holds the requests of the capture pipeline, allocated when the
+// streams are configured, so that capturing a frame allocates no memory.
+class RequestPool {
+    public:
+        RequestPool();
+        ~RequestPool();
+
+        // Replace the requests with 'requests' requests of up to 'buffers'
+        // output buffers each. No request can be in use.
+        int resize(unsigned int requests, unsigned int buffers);
+        // Wait for a free request
+        CaptureRequest *get();
+        // Return a request to the pool
+        void put(CaptureRequest *r);
+        // Largest number of output buffers of a request
+        unsigned int getMaxBuffers() const { return mMaxBuffers; }
+
+    private:
+        // Free the requests, and the settings buffers they grew
+        void clear();
+
+        // All the requests, and their output buffers
+        CaptureRequest *mRequests;
+        camera3_stream_buffer_t *mBuffers;
+        unsigned int mNumRequests;
+        unsigned int mMaxBuffers;
+        // Free requests, linked by mNext
+        CaptureRequest *mFree;
+        // Lock protecting mFree, and condition signaled on put
+        pthread_mutex_t mMutex;
+        pthread_cond_t mCond;
+};
+} // namespace default_camera_hal
+
+#endif // REQUEST_QUEUE_H_
@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <system/camera_metadata.h>
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "Settings"
+#include <cutils/log.h>
+
+#include "Settings.h"
+
+namespace default_camera_hal {
+
+TagSet::TagSet()
+{
+    clear();
+}
+
+void TagSet::clear()
+{
+    memset(mSections, 0, sizeof(mSections));
+    mOther = false;
+}
+
+void TagSet::add(uint32_t tag)
+{
+    uint32_t section = tag >> 16;
+    uint32_t index = tag & 0xffff;
+    if (section >= ANDROID_SECTION_COUNT) {
+        mOther = true;
+        return;
+    }
+    mSections[section] |= 1ULL << (index < 63 ? index : 63);
+}
+
+bool TagSet::contains(uint32_t tag) const
+{
+    uint32_t section = tag >> 16;
+    uint32_t index = tag & 0xffff;
+    if (section >= ANDROID_SECTION_COUNT)
+        return mOther;
+    return mSections[section] & (1ULL << (index < 63 ? index : 63));
+}
+
+bool TagSet::empty() const
+{
+    if (mOther)
+        return false;
+    for (int i = 0; i < ANDROID_SECTION_COUNT; i++) {
+        if (mSections[i])
+            return false;
+    }
+    return true;
+}
+
+static bool sameValues(const camera_metadata_ro_entry_t &a,
+        const camera_metadata_ro_entry_t &b)
+{
+    return a.type == b.type && a.count == b.count &&
+            memcmp(a.data.u8, b.data.u8,
+                    a.count * camera_metadata_type_size[a.type]) == 0;
+}
+
+bool diffSettings(const camera_metadata_t *old,
+        const camera_metadata_t *settings, TagSet *changed)
+{
+    size_t count = get_camera_metadata_entry_count(settings);
+    size_t oldCount = old != NULL ? get_camera_metadata_entry_count(old) : 0;
+    bool sameLayout = old != NULL && count == oldCount;
+    size_t matched = 0;
+    camera_metadata_ro_entry_t e, o;
+
+    changed->clear();
+    for (size_t i = 0; i < count; i++) {
+        get_camera_metadata_ro_entry(settings, i, &e);
+        // The framework usually sends the same tags in the same order, only
+        // look the tag up when it moved
+        if (i >= oldCount || get_camera_metadata_ro_entry(old, i, &o) ||
+                o.tag != e.tag) {
+            sameLayout = false;
+            if (old == NULL || find_camera_metadata_ro_entry(old, e.tag, &o)) {
+                changed->add(e.tag);
+                continue;
+            }
+        }
+        matched++;
+        if (o.type != e.type || o.count != e.count)
+            sameLayout = false;
+        if (!sameValues(o, e))
+            changed->add(e.tag);
+    }
+
+    // Some tags were removed
+    if (matched < oldCount) {
+        for (size_t i = 0; i < oldCount; i++) {
+            get_camera_metadata_ro_entry(old, i, &o);
+            if (find_camera_metadata_ro_entry(settings, o.tag, &e))
+                changed->add(o.tag);
+        }
+    }
+    return sameLayout;
+}
+
+// Find a static characteristic, returns false if the camera has none
+static bool findStatic(const camera_metadata_t *static_info, uint32_t tag,
+        camera_metadata_ro_entry_t *entry)
+{
+    return static_info != NULL &&
+            find_camera_metadata_ro_entry(static_info, tag, entry) == 0 &&
+            entry->count > 0;
+}
+
+// Check that 'values' is one of the tuples of 'n' values of 'entry'
+static bool isTupleOf(const camera_metadata_ro_entry_t &entry,
+        const int32_t *values, size_t n)
+{
+    for (size_t i = 0; i + n <= entry.count; i += n) {
+        if (memcmp(entry.data.i32 + i, values, n * sizeof(*values)) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Check that the mode in 'e' is one of the modes of the static
+// characteristic 'available'
+static bool isAvailableMode(const camera_metadata_t *static_info,
+        uint32_t available, const camera_metadata_ro_entry_t &e)
+{
+    camera_metadata_ro_entry_t s;
+
+    if (e.count != 1)
+        return false;
+    if (!findStatic(static_info, available, &s))
+        return true;
+    return memchr(s.data.u8, e.data.u8[0], s.count) != NULL;
+}
+
+static bool isValidEntry(const camera_metadata_t *static_info,
+        const camera_metadata_ro_entry_t &e)
+{
+    camera_metadata_ro_entry_t s;
+
+    if ((e.tag >> 16) < VENDOR_SECTION &&
+            get_camera_metadata_tag_type(e.tag) != e.type) {
+        ALOGE("%s: Unknown tag or wrong type for %s (%#x)", __func__,
+                get_camera_metadata_tag_name(e.tag), e.tag);
+        return false;
+    }
+
+    switch (e.tag) {
+    case ANDROID_CONTROL_AE_EXPOSURE_COMPENSATION:
+        if (!findStatic(static_info, ANDROID_CONTROL_AE_COMPENSATION_RANGE, &s))
+            return true;
+        return e.count == 1 && s.count == 2 &&
+                e.data.i32[0] >= s.data.i32[0] &&
+                e.data.i32[0] <= s.data.i32[1];
+    case ANDROID_CONTROL_AE_TARGET_FPS_RANGE:
+        if (!findStatic(static_info,
+                    ANDROID_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES, &s))
+            return true;
+        return e.count == 2 && isTupleOf(s, e.data.i32, 2);
+    case ANDROID_CONTROL_AE_ANTIBANDING_MODE:
+        return isAvailableMode(static_info,
+                ANDROID_CONTROL_AE_AVAILABLE_ANTIBANDING_MODES, e);
+    case ANDROID_CONTROL_AE_MODE:
+        return isAvailableMode(static_info, ANDROID_CONTROL_AE_AVAILABLE_MODES,
+                e);
+    case ANDROID_CONTROL_AF_MODE:
+        return isAvailableMode(static_info, ANDROID_CONTROL_AF_AVAILABLE_MODES,
+                e);
+    case ANDROID_CONTROL_AWB_MODE:
+        return isAvailableMode(static_info,
+                ANDROID_CONTROL_AWB_AVAILABLE_MODES, e);
+    case ANDROID_CONTROL_EFFECT_MODE:
+        return isAvailableMode(static_info, ANDROID_CONTROL_AVAILABLE_EFFECTS,
+                e);
+    case ANDROID_CONTROL_SCENE_MODE:
+        // Templates set no scene mode, which isn't an available one
+        if (e.count == 1 &&
+                e.data.u8[0] == ANDROID_CONTROL_SCENE_MODE_UNSUPPORTED)
+            return true;
+        return isAvailableMode(static_info,
+                ANDROID_CONTROL_AVAILABLE_SCENE_MODES, e);
+    case ANDROID_CONTROL_AE_REGIONS:
+    case ANDROID_CONTROL_AF_REGIONS:
+    case ANDROID_CONTROL_AWB_REGIONS:
+        // (xmin, ymin, xmax, ymax, weight) per region
+        if (e.count % 5)
+            return false;
+        if (!findStatic(static_info, ANDROID_CONTROL_MAX_REGIONS, &s))
+            return true;
+        return e.count / 5 <= size_t(s.data.i32[0]);
+    case ANDROID_JPEG_THUMBNAIL_SIZE:
+        if (!findStatic(static_info, ANDROID_JPEG_AVAILABLE_THUMBNAIL_SIZES,
+                    &s))
+            return true;
+        return e.count == 2 && isTupleOf(s, e.data.i32, 2);
+    case ANDROID_LENS_FOCAL_LENGTH:
+        if (!findStatic(static_info, ANDROID_LENS_INFO_AVAILABLE_FOCAL_LENGTHS,
+                    &s))
+            return true;
+        for (size_t i = 0; e.count == 1 && i < s.count; i++) {
+            if (s.data.f[i] == e.data.f[0])
+                return true;
+        }
+        return false;
+    case ANDROID_SCALER_CROP_REGION:
+        // (left, top, width, height) inside the active array
+        if (e.count < 4 || e.data.i32[0] < 0 || e.data.i32[1] < 0 ||
+                e.data.i32[2] <= 0 || e.data.i32[3] <= 0)
+            return false;
+        if (!findStatic(static_info, ANDROID_SENSOR_INFO_ACTIVE_ARRAY_SIZE,
+                    &s) || s.count < 4)
+            return true;
+        return e.data.i32[0] + e.data.i32[2] <= s.data.i32[2] &&
+                e.data.i32[1] + e.data.i32[3] <= s.data.i32[3];
+    case ANDROID_SENSOR_SENSITIVITY:
+        if (!findStatic(static_info, ANDROID_SENSOR_INFO_SENSITIVITY_RANGE, &s))
+            return true;
+        return e.count == 1 && s.count == 2 &&
+                e.data.i32[0] >= s.data.i32[0] &&
+                e.data.i32[0] <= s.data.i32[1];
+    case ANDROID_SENSOR_EXPOSURE_TIME:
+        if (e.count != 1 || e.data.i64[0] < 0)
+            return false;
+        if (findStatic(static_info, ANDROID_SENSOR_INFO_EXPOSURE_TIME_RANGE,
+                    &s) && s.count == 2 &&
+                (e.data.i64[0] < s.data.i64[0] ||
+                 e.data.i64[0] > s.data.i64[1]))
+            return false;
+        // Fall through, the exposure cannot be longer than a frame
+    case ANDROID_SENSOR_FRAME_DURATION:
+        if (e.count != 1 || e.data.i64[0] < 0)
+            return false;
+        if (!findStatic(static_info, ANDROID_SENSOR_INFO_MAX_FRAME_DURATION,
+                    &s))
+            return true;
+        return e.data.i64[0] <= s.data.i64[0];
+    default:
+        return true;
+    }
+}
+
+bool validateSettings(const camera_metadata_t *static_info,
+        const camera_metadata_t *settings, const TagSet &tags)
+{
+    size_t count = get_camera_metadata_entry_count(settings);
+    camera_metadata_ro_entry_t e;
+
+    if (tags.empty())
+        return true;
+    for (size_t i = 0; i < count; i++) {
+        get_camera_metadata_ro_entry(settings, i, &e);
+        if (!tags.contains(e.tag))
+            continue;
+        if (!isValidEntry(static_info, e)) {
+            ALOGE("%s: Invalid value for %s.%s", __func__,
+                    get_camera_metadata_section_name(e.tag),
+                    get_camera_metadata_tag_name(e.tag));
+            return false;
+        }
+    }
+    return true;
+}
+} // namespace default_camera_hal
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SETTINGS_H_
+#define SETTINGS_H_
+
+#include <stdint.h>
+#include <system/camera_metadata.h>
+
+namespace default_camera_hal {
+// TagSet is a set of metadata tags, such as the tags a request changes
+class TagSet {
+    public:
+        TagSet();
+
+        void clear();
+        void add(uint32_t tag);
+        bool contains(uint32_t tag) const;
+        bool empty() const;
+
+    private:
+        // One bit per tag of each section, the tags past the last bit of a
+        // section share it
+        uint64_t mSections[ANDROID_SECTION_COUNT];
+        // Any vendor or unknown tag
+        bool mOther;
+};
+
+// Compare capture settings to the previous ones, 'old', which can be NULL.
+// 'changed' receives the tags added, removed or with a different value.
+// Returns true if both have the same entries, in the same order and with
+// the same number of values, so that the changed entries of 'old' can be
+// updated in place.
+bool diffSettings(const camera_metadata_t *old,
+        const camera_metadata_t *settings, TagSet *changed);
+
+// Check the entries of 'settings' whose tags are in 'tags' against the
+// static characteristics of the camera.
+bool validateSettings(const camera_metadata_t *static_info,
+        const camera_metadata_t *settings, const TagSet &tags);
+} // namespace default_camera_hal
+
+#endif // SETTINGS_H_
@@ -41,12 +41,14 @@ Stream::Stream(int id, camera3_stream_t *s)
     mFormat(s->format),
     mUsage(0),
     mMaxBuffers(0),
+    mInflightBuffers(0),
     mRegistered(false),
     mBuffers(0),
     mNumBuffers(0)
 {
     // NULL (default) pthread mutex attributes
     pthread_mutex_init(&mMutex, NULL);
+    pthread_cond_init(&mInflightCond, NULL);
 }
 
 Stream::~Stream()
@@ -54,6 +56,7 @@ Stream::~Stream()
     pthread_mutex_lock(&mMutex);
     unregisterBuffers_L();
     pthread_mutex_unlock(&mMutex);
+    pthread_cond_destroy(&mInflightCond);
 }
 
 void Stream::setUsage(uint32_t usage)
@@ -78,11 +81,34 @@ void Stream::setMaxBuffers(uint32_t max_buffers)
     pthread_mutex_unlock(&mMutex);
 }
 
+void Stream::acquireInflightBuffer()
+{
+    pthread_mutex_lock(&mMutex);
+    while (mInflightBuffers > 0 && mInflightBuffers >= mMaxBuffers)
+        pthread_cond_wait(&mInflightCond, &mMutex);
+    mInflightBuffers++;
+    pthread_mutex_unlock(&mMutex);
+}
+
+void Stream::releaseInflightBuffer()
+{
+    pthread_mutex_lock(&mMutex);
+    if (mInflightBuffers > 0)
+        mInflightBuffers--;
+    pthread_cond_signal(&mInflightCond);
+    pthread_mutex_unlock(&mMutex);
+}
+
 int Stream::getType()
 {
     return mType;
 }
 
+int Stream::getFormat()
+{
+    return mFormat;
+}
+
 bool Stream::isInputType()
 {
     return mType == CAMERA3_STREAM_INPUT ||
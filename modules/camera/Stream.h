@@ -37,7 +37,14 @@ class Stream {
         void setUsage(uint32_t usage);
         void setMaxBuffers(uint32_t max_buffers);
 
+        // Wait until fewer than max_buffers buffers of this stream are in
+        // flight, and count one more
+        void acquireInflightBuffer();
+        // Count a buffer returned to the framework
+        void releaseInflightBuffer();
+
         int getType();
+        int getFormat();
         bool isInputType();
         bool isOutputType();
         bool isRegistered();
@@ -65,6 +72,10 @@ class Stream {
         uint32_t mUsage;
         // Max simultaneous in-flight buffers for this stream
         uint32_t mMaxBuffers;
+        // Buffers of this stream currently in flight
+        uint32_t mInflightBuffers;
+        // Condition signaled when a buffer is returned to the framework
+        pthread_cond_t mInflightCond;
         // Buffers have been registered for this stream and are ready
         bool mRegistered;
         // Array of handles to buffers currently in use by the stream
@@ -0,0 +1,511 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdlib>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <hardware/camera3.h>
+#include <hardware/gralloc.h>
+#include <system/graphics.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "TestPattern"
+#include <cutils/log.h>
+
+#define ATRACE_TAG (ATRACE_TAG_CAMERA | ATRACE_TAG_HAL)
+#include <cutils/trace.h>
+#include "ScopedTrace.h"
+
+#include "TestPattern.h"
+
+// Side of the checkerboard squares, and distance they move every frame
+#define CHECKER_SIZE 64
+#define CHECKER_STEP 4
+// Position and scale of the frame number
+#define DIGIT_ORIGIN 8
+#define DIGIT_SCALE 4
+// RAW_SENSOR samples are 10-bit
+#define RAW_WHITE 1023
+
+namespace default_camera_hal {
+
+static const TestPattern::rgb sColorBars[] = {
+    { 255, 255, 255 },  // white
+    { 255, 255,   0 },  // yellow
+    {   0, 255, 255 },  // cyan
+    {   0, 255,   0 },  // green
+    { 255,   0, 255 },  // magenta
+    { 255,   0,   0 },  // red
+    {   0,   0, 255 },  // blue
+    {   0,   0,   0 },  // black
+};
+
+static const TestPattern::rgb sCheckers[] = {
+    {  64,  64,  64 },
+    { 192, 192, 192 },
+};
+
+static const TestPattern::rgb sBlack = { 0, 0, 0 };
+static const TestPattern::rgb sWhite = { 255, 255, 255 };
+
+// 3x5 pixel digits, one bit per pixel, top row in the most significant bits
+static const uint16_t sDigits[10] = {
+    0x7b6f, 0x2c97, 0x73e7, 0x73cf, 0x5bc9,
+    0x79cf, 0x79ef, 0x7249, 0x7bef, 0x7bcf,
+};
+
+// BT.601 limited range conversion
+static inline uint8_t toY(const TestPattern::rgb &c)
+{
+    return ((66 * c.r + 129 * c.g + 25 * c.b + 128) >> 8) + 16;
+}
+
+static inline uint8_t toCb(const TestPattern::rgb &c)
+{
+    return ((-38 * c.r - 74 * c.g + 112 * c.b + 128) >> 8) + 128;
+}
+
+static inline uint8_t toCr(const TestPattern::rgb &c)
+{
+    return ((112 * c.r - 94 * c.g - 18 * c.b + 128) >> 8) + 128;
+}
+
+// 10-bit sample of an RGGB color filter array at (x, y)
+static inline uint16_t toRaw(const TestPattern::rgb &c, uint32_t x, uint32_t y)
+{
+    uint8_t v = (y & 1) ? ((x & 1) ? c.b : c.g) : ((x & 1) ? c.g : c.r);
+    return (v << 2) | (v >> 6);
+}
+
+static inline uint32_t toRGBA(const TestPattern::rgb &c)
+{
+    return c.r | (c.g << 8) | (c.b << 16) | 0xff000000;
+}
+
+// Copy a row template, adding then subtracting, with saturation, the bytes
+// of 'add' and 'sub' to the bytes of each 32-bit word.
+static void paintRow(uint8_t *dst, const uint8_t *src, uint32_t add,
+        uint32_t sub, size_t bytes)
+{
+    if (add == 0 && sub == 0) {
+        memcpy(dst, src, bytes);
+        return;
+    }
+
+    size_t i = 0;
+#if defined(__ARM_NEON__)
+    const uint8x16_t a = vreinterpretq_u8_u32(vdupq_n_u32(add));
+    const uint8x16_t s = vreinterpretq_u8_u32(vdupq_n_u32(sub));
+    for (; i + 16 <= bytes; i += 16)
+        vst1q_u8(dst + i, vqsubq_u8(vqaddq_u8(vld1q_u8(src + i), a), s));
+#elif defined(__SSE2__)
+    const __m128i a = _mm_set1_epi32(add);
+    const __m128i s = _mm_set1_epi32(sub);
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        v = _mm_subs_epu8(_mm_adds_epu8(v, a), s);
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+#endif
+    for (; i < bytes; i++) {
+        int shift = (i & 3) * 8;
+        int v = src[i] + ((add >> shift) & 0xff);
+        v = (v > 255 ? 255 : v) - ((sub >> shift) & 0xff);
+        dst[i] = v < 0 ? 0 : v;
+    }
+}
+
+// Copy a row template of RAW_SENSOR samples, adding the samples of 'add' to
+// each pair of samples, with saturation to RAW_WHITE.
+static void paintRow16(uint16_t *dst, const uint16_t *src, uint32_t add,
+        size_t count)
+{
+    if (add == 0) {
+        memcpy(dst, src, count * sizeof(*dst));
+        return;
+    }
+
+    size_t i = 0;
+#if defined(__ARM_NEON__)
+    const uint16x8_t a = vreinterpretq_u16_u32(vdupq_n_u32(add));
+    const uint16x8_t white = vdupq_n_u16(RAW_WHITE);
+    for (; i + 8 <= count; i += 8)
+        vst1q_u16(dst + i, vminq_u16(vqaddq_u16(vld1q_u16(src + i), a), white));
+#elif defined(__SSE2__)
+    const __m128i a = _mm_set1_epi32(add);
+    const __m128i white = _mm_set1_epi16(RAW_WHITE);
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        v = _mm_min_epi16(_mm_adds_epu16(v, a), white);
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+#endif
+    for (; i < count; i++) {
+        int v = src[i] + ((add >> ((i & 1) * 16)) & 0xffff);
+        dst[i] = v > RAW_WHITE ? RAW_WHITE : v;
+    }
+}
+
+TestPattern::TestPattern()
+  : mPattern(CHECKERBOARD),
+    mWidth(0),
+    mHeight(0),
+    mFrame(0),
+    mOffset(0),
+    mTemplates(NULL),
+    mTemplatesSize(0)
+{
+}
+
+TestPattern::~TestPattern()
+{
+    free(mTemplates);
+}
+
+void TestPattern::setPattern(int pattern)
+{
+    if (pattern < 0 || pattern >= NUM_PATTERNS) {
+        ALOGE("%s: Invalid test pattern %d", __func__, pattern);
+        return;
+    }
+    mPattern = pattern;
+}
+
+int TestPattern::render(const gralloc_module_t *gralloc,
+        const camera3_stream_t *stream, buffer_handle_t *buffer,
+        uint32_t frame)
+{
+    CAMTRACE_CALL();
+    const int usage = GRALLOC_USAGE_SW_WRITE_OFTEN;
+    bool flexible = gralloc->common.module_api_version >=
+            GRALLOC_MODULE_API_VERSION_0_2 && gralloc->lock_ycbcr != NULL;
+    canvas c;
+    int res;
+
+    setFrame(stream->width, stream->height, frame);
+    c.format = stream->format;
+    c.base = NULL;
+    // lock() does not return the stride: the sizes advertised by the camera
+    // are 16-pixel multiples, and gralloc does not pad the rows of buffers
+    // the camera writes
+    c.stride = mWidth;
+
+    switch (stream->format) {
+    case HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED:
+        // gralloc picks the format, only paint the buffers it describes as
+        // YUV: the layout of the others is unknown
+        if (!flexible) {
+            res = -EINVAL;
+            break;
+        }
+        c.format = HAL_PIXEL_FORMAT_YCbCr_420_888;
+        res = gralloc->lock_ycbcr(gralloc, *buffer, usage, 0, 0, mWidth,
+                mHeight, &c.ycbcr);
+        break;
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+    case HAL_PIXEL_FORMAT_RGBX_8888:
+    case HAL_PIXEL_FORMAT_RAW_SENSOR:
+        res = gralloc->lock(gralloc, *buffer, usage, 0, 0, mWidth, mHeight,
+                &c.base);
+        break;
+    case HAL_PIXEL_FORMAT_YCbCr_420_888:
+        if (!flexible) {
+            res = -EINVAL;
+            break;
+        }
+        res = gralloc->lock_ycbcr(gralloc, *buffer, usage, 0, 0, mWidth,
+                mHeight, &c.ycbcr);
+        break;
+    default:
+        ALOGE("%s: Unsupported stream format %d", __func__, stream->format);
+        return -EINVAL;
+    }
+    if (res) {
+        ALOGE("%s: Failed to lock buffer %p: %s(%d)", __func__, *buffer,
+                strerror(-res), res);
+        return res;
+    }
+
+    switch (c.format) {
+    case HAL_PIXEL_FORMAT_YCbCr_420_888:
+        paintYCbCr(c);
+        break;
+    case HAL_PIXEL_FORMAT_RAW_SENSOR:
+        paintRaw16(c);
+        break;
+    default:
+        paintRGBA(c);
+        break;
+    }
+    paintFrameNumber(c);
+
+    res = gralloc->unlock(gralloc, *buffer);
+    if (res)
+        ALOGE("%s: Failed to unlock buffer %p: %s(%d)", __func__, *buffer,
+                strerror(-res), res);
+    return res;
+}
+
+void TestPattern::setFrame(uint32_t width, uint32_t height, uint32_t frame)
+{
+    mWidth = width;
+    mHeight = height;
+    mFrame = frame;
+    mOffset = (frame * CHECKER_STEP) % (2 * CHECKER_SIZE);
+}
+
+TestPattern::rgb TestPattern::colorAt(uint32_t x, int phase) const
+{
+    switch (mPattern) {
+    case COLOR_BARS:
+        return sColorBars[uint64_t(x) * 8 / mWidth];
+    case GRADIENT: {
+        // Red to blue from left to right, rowGreen() adds green downwards
+        uint8_t r = mWidth > 1 ? x * 255 / (mWidth - 1) : 0;
+        rgb c = { r, 0, uint8_t(255 - r) };
+        return c;
+    }
+    default:
+        return sCheckers[(((x + mOffset) / CHECKER_SIZE) + phase) & 1];
+    }
+}
+
+int TestPattern::rowPhase(uint32_t y) const
+{
+    if (mPattern != CHECKERBOARD)
+        return 0;
+    return ((y + mOffset) / CHECKER_SIZE) & 1;
+}
+
+uint8_t TestPattern::rowGreen(uint32_t y) const
+{
+    if (mPattern != GRADIENT || mHeight <= 1)
+        return 0;
+    return y * 255 / (mHeight - 1);
+}
+
+void TestPattern::paintRGBA(const canvas &c)
+{
+    size_t rowSize = mWidth * 4;
+    uint8_t *templates = getTemplates(2 * rowSize);
+    if (templates == NULL)
+        return;
+
+    for (int phase = 0; phase < 2; phase++) {
+        uint32_t *t = reinterpret_cast<uint32_t*>(templates + phase * rowSize);
+        for (uint32_t x = 0; x < mWidth; x++)
+            t[x] = toRGBA(colorAt(x, phase));
+    }
+
+    uint8_t *dst = static_cast<uint8_t*>(c.base);
+    for (uint32_t y = 0; y < mHeight; y++, dst += c.stride * 4) {
+        const uint8_t *src = templates + rowPhase(y) * rowSize;
+        paintRow(dst, src, rowGreen(y) << 8, 0, rowSize);
+    }
+}
+
+void TestPattern::paintYCbCr(const canvas &c)
+{
+    const android_ycbcr &ycbcr = c.ycbcr;
+    uint8_t *cb = static_cast<uint8_t*>(ycbcr.cb);
+    uint8_t *cr = static_cast<uint8_t*>(ycbcr.cr);
+    uint32_t chromaWidth = (mWidth + 1) / 2;
+    uint32_t chromaHeight = (mHeight + 1) / 2;
+    size_t step = ycbcr.chroma_step;
+    // Semi-planar chroma is painted as one row of interleaved samples,
+    // starting with the first of Cb and Cr in memory
+    bool interleaved = step == 2 && (cr == cb + 1 || cb == cr + 1);
+    uint8_t *chroma = cb < cr ? cb : cr;
+    size_t chromaRowSize = step == 2 ? chromaWidth * 2 : chromaWidth;
+    size_t phaseSize = mWidth + 2 * chromaRowSize;
+    uint8_t *templates = getTemplates(2 * phaseSize);
+    if (templates == NULL)
+        return;
+
+    // Each phase holds a luma row, and a row of each chroma plane or one
+    // interleaved chroma row
+    for (int phase = 0; phase < 2; phase++) {
+        uint8_t *y = templates + phase * phaseSize;
+        uint8_t *u = y + mWidth;
+        uint8_t *v = u + chromaRowSize;
+        for (uint32_t x = 0; x < mWidth; x++)
+            y[x] = toY(colorAt(x, phase));
+        for (uint32_t x = 0; x < chromaWidth; x++) {
+            rgb color = colorAt(2 * x, phase);
+            if (interleaved) {
+                u[2 * x + (cb > cr)] = toCb(color);
+                u[2 * x + (cr > cb)] = toCr(color);
+            } else {
+                u[x] = toCb(color);
+                v[x] = toCr(color);
+            }
+        }
+    }
+
+    uint8_t *dst = static_cast<uint8_t*>(ycbcr.y);
+    for (uint32_t y = 0; y < mHeight; y++, dst += ycbcr.ystride) {
+        const uint8_t *src = templates + rowPhase(y) * phaseSize;
+        uint8_t green = rowGreen(y);
+        paintRow(dst, src, ((129 * green + 128) >> 8) * 0x01010101, 0, mWidth);
+    }
+
+    for (uint32_t y = 0; y < chromaHeight; y++) {
+        const uint8_t *u = templates + rowPhase(2 * y) * phaseSize + mWidth;
+        const uint8_t *v = u + chromaRowSize;
+        // Green lowers both Cb and Cr
+        uint8_t green = rowGreen(2 * y);
+        uint32_t subCb = ((74 * green + 128) >> 8) * 0x01010101;
+        uint32_t subCr = ((94 * green + 128) >> 8) * 0x01010101;
+        size_t offset = y * ycbcr.cstride;
+        if (interleaved) {
+            uint32_t sub = cb < cr ? (subCb & 0x00ff00ff) | (subCr & 0xff00ff00)
+                    : (subCr & 0x00ff00ff) | (subCb & 0xff00ff00);
+            paintRow(chroma + offset, u, 0, sub, chromaRowSize);
+        } else if (step == 1) {
+            paintRow(cb + offset, u, 0, subCb, chromaWidth);
+            paintRow(cr + offset, v, 0, subCr, chromaWidth);
+        } else {
+            // Unusual layout, one sample at a time
+            uint8_t dCb = subCb & 0xff, dCr = subCr & 0xff;
+            for (uint32_t x = 0; x < chromaWidth; x++) {
+                cb[offset + x * step] = u[x] > dCb ? u[x] - dCb : 0;
+                cr[offset + x * step] = v[x] > dCr ? v[x] - dCr : 0;
+            }
+        }
+    }
+}
+
+void TestPattern::paintRaw16(const canvas &c)
+{
+    // Each phase holds an RGRG row and a GBGB row
+    size_t rowSize = mWidth * sizeof(uint16_t);
+    uint8_t *templates = getTemplates(4 * rowSize);
+    if (templates == NULL)
+        return;
+
+    for (int phase = 0; phase < 2; phase++) {
+        for (uint32_t r = 0; r < 2; r++) {
+            uint16_t *t = reinterpret_cast<uint16_t*>(templates +
+                    (2 * phase + r) * rowSize);
+            for (uint32_t x = 0; x < mWidth; x++)
+                t[x] = toRaw(colorAt(x, phase), x, r);
+        }
+    }
+
+    uint16_t *dst = static_cast<uint16_t*>(c.base);
+    for (uint32_t y = 0; y < mHeight; y++, dst += c.stride) {
+        const uint16_t *src = reinterpret_cast<const uint16_t*>(templates +
+                (2 * rowPhase(y) + (y & 1)) * rowSize);
+        uint8_t green = rowGreen(y);
+        uint32_t add = (green << 2) | (green >> 6);
+        // Green samples are odd on RG rows, even on GB rows
+        paintRow16(dst, src, (y & 1) ? add : add << 16, mWidth);
+    }
+}
+
+void TestPattern::paintFrameNumber(const canvas &c)
+{
+    char digits[11];
+    int count = snprintf(digits, sizeof(digits), "%u", mFrame);
+    const uint32_t advance = 4 * DIGIT_SCALE;
+
+    fillRect(c, DIGIT_ORIGIN, DIGIT_ORIGIN, count * advance + DIGIT_SCALE,
+            7 * DIGIT_SCALE, sBlack);
+    for (int i = 0; i < count; i++) {
+        uint16_t glyph = sDigits[digits[i] - '0'];
+        uint32_t left = DIGIT_ORIGIN + DIGIT_SCALE + i * advance;
+        for (int bit = 0; bit < 15; bit++) {
+            if (!(glyph & (0x4000 >> bit)))
+                continue;
+            fillRect(c, left + (bit % 3) * DIGIT_SCALE,
+                    DIGIT_ORIGIN + DIGIT_SCALE + (bit / 3) * DIGIT_SCALE,
+                    DIGIT_SCALE, DIGIT_SCALE, sWhite);
+        }
+    }
+}
+
+void TestPattern::fillRect(const canvas &c, uint32_t x, uint32_t y,
+        uint32_t w, uint32_t h, rgb color)
+{
+    if (x >= mWidth || y >= mHeight)
+        return;
+    if (w > mWidth - x)
+        w = mWidth - x;
+    if (h > mHeight - y)
+        h = mHeight - y;
+
+    switch (c.format) {
+    case HAL_PIXEL_FORMAT_YCbCr_420_888: {
+        const android_ycbcr &ycbcr = c.ycbcr;
+        uint8_t *dst = static_cast<uint8_t*>(ycbcr.y) + y * ycbcr.ystride + x;
+        for (uint32_t j = 0; j < h; j++, dst += ycbcr.ystride)
+            memset(dst, toY(color), w);
+        uint8_t *cb = static_cast<uint8_t*>(ycbcr.cb);
+        uint8_t *cr = static_cast<uint8_t*>(ycbcr.cr);
+        for (uint32_t j = y / 2; j < (y + h + 1) / 2; j++) {
+            size_t offset = j * ycbcr.cstride;
+            for (uint32_t i = x / 2; i < (x + w + 1) / 2; i++) {
+                cb[offset + i * ycbcr.chroma_step] = toCb(color);
+                cr[offset + i * ycbcr.chroma_step] = toCr(color);
+            }
+        }
+        break;
+    }
+    case HAL_PIXEL_FORMAT_RAW_SENSOR: {
+        uint16_t *dst = static_cast<uint16_t*>(c.base) + y * c.stride;
+        for (uint32_t j = y; j < y + h; j++, dst += c.stride) {
+            for (uint32_t i = x; i < x + w; i++)
+                dst[i] = toRaw(color, i, j);
+        }
+        break;
+    }
+    default: {
+        uint32_t *dst = static_cast<uint32_t*>(c.base) + y * c.stride;
+        uint32_t pixel = toRGBA(color);
+        for (uint32_t j = 0; j < h; j++, dst += c.stride) {
+            for (uint32_t i = x; i < x + w; i++)
+                dst[i] = pixel;
+        }
+        break;
+    }
+    }
+}
+
+uint8_t *TestPattern::getTemplates(size_t size)
+{
+    if (size <= mTemplatesSize)
+        return mTemplates;
+
+    uint8_t *templates = static_cast<uint8_t*>(realloc(mTemplates, size));
+    if (templates == NULL) {
+        ALOGE("%s: Failed to allocate %zu bytes of row templates", __func__,
+                size);
+        return NULL;
+    }
+    mTemplates = templates;
+    mTemplatesSize = size;
+    return mTemplates;
+}
+} // namespace default_camera_hal
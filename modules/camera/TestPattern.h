@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TEST_PATTERN_H_
+#define TEST_PATTERN_H_
+
+#include <stdint.h>
+#include <hardware/camera3.h>
+#include <hardware/gralloc.h>
+#include <system/graphics.h>
+
+namespace default_camera_hal {
+// TestPattern is a synthetic sensor: it paints test patterns, stamped with
+// the frame number, into the output buffers.
+class TestPattern {
+    public:
+        // Patterns, selected with the camera.default.test_pattern property
+        enum {
+            COLOR_BARS = 0,
+            GRADIENT = 1,
+            // Checkerboard moving by a few pixels every frame (default)
+            CHECKERBOARD = 2,
+            NUM_PATTERNS
+        };
+
+        // Pixel value of the pattern, 8-bit RGB
+        struct rgb {
+            uint8_t r;
+            uint8_t g;
+            uint8_t b;
+        };
+
+        TestPattern();
+        ~TestPattern();
+
+        // Select the pattern painted, one of the values above
+        void setPattern(int pattern);
+        // Paint frame 'frame' into a buffer of 'stream', through gralloc.
+        // Returns an error, the buffer untouched, if it can't be painted.
+        int render(const gralloc_module_t *gralloc,
+                const camera3_stream_t *stream, buffer_handle_t *buffer,
+                uint32_t frame);
+
+    private:
+        // Locked buffer being painted
+        struct canvas {
+            int format;
+            // RGBA_8888 and RAW_SENSOR buffers
+            void *base;
+            uint32_t stride;
+            // YCbCr buffers
+            struct android_ycbcr ycbcr;
+        };
+
+        // Set up the pattern of a frame
+        void setFrame(uint32_t width, uint32_t height, uint32_t frame);
+        // Color of the pattern at column x of the rows of phase 'phase'
+        rgb colorAt(uint32_t x, int phase) const;
+        // Phase of row y: rows of the same phase only differ by rowGreen()
+        int rowPhase(uint32_t y) const;
+        // Green added to row y
+        uint8_t rowGreen(uint32_t y) const;
+
+        // Painters of each buffer format
+        void paintRGBA(const canvas &c);
+        void paintYCbCr(const canvas &c);
+        void paintRaw16(const canvas &c);
+        // Stamp the frame number in the top left corner
+        void paintFrameNumber(const canvas &c);
+        void fillRect(const canvas &c, uint32_t x, uint32_t y, uint32_t w,
+                uint32_t h, rgb color);
+
+        // Get at least 'size' bytes of row templates
+        uint8_t *getTemplates(size_t size);
+
+        // Pattern painted, one of the values above
+        int mPattern;
+        // Size and number of the frame being painted
+        uint32_t mWidth;
+        uint32_t mHeight;
+        uint32_t mFrame;
+        // Offset of the checkerboard in this frame
+        uint32_t mOffset;
+        // Row templates, reallocated when a wider stream needs them
+        uint8_t *mTemplates;
+        size_t mTemplatesSize;
+};
+} // namespace default_camera_hal
+
+#endif // TEST_PATTERN_H_
@@ -25,7 +25,12 @@ LOCAL_SHARED_LIBRARIES := liblog libcutils
 LOCAL_SRC_FILES := 	\
 	gralloc.cpp 	\
 	framebuffer.cpp \
-	mapper.cpp
+	mapper.cpp \
+	pool.cpp \
+	blit.cpp \
+	frame_stats.cpp \
+	backing.cpp \
+	alloc_table.cpp
 	
 LOCAL_MODULE := gralloc.default
 LOCAL_CFLAGS:= -DLOG_TAG=\"gralloc\"
@@ -0,0 +1,231 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include <hardware/memtrack.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+/*
+ * Every buffer handed out by an allocation device, until it is freed, has an
+ * allocation record. The records are linked, oldest first, in a list that
+ * dump() and getAllocationMemory() walk, and hashed by handle so that
+ * gralloc_free() finds its record without walking the list. Buffers kept by
+ * the buffer pool are not allocated anymore and have no record, the pool
+ * accounts for them.
+ */
+
+#define ALLOCATION_BUCKETS  64
+
+// Number of records getAllocationMemory() always returns.
+#define MEMTRACK_RECORDS    2
+
+struct allocation {
+    // list of all the allocations, oldest first
+    allocation* prev;
+    allocation* next;
+    allocation* nextByHandle;
+    alloc_device_t const* owner;
+    private_handle_t* hnd;
+    int64_t created;
+};
+
+struct allocation_table {
+    pthread_mutex_t lock;
+    allocation head;
+    allocation* byHandle[ALLOCATION_BUCKETS];
+    size_t count;
+};
+
+static allocation_table sAllocations = {
+    lock: PTHREAD_MUTEX_INITIALIZER,
+    head: { &sAllocations.head, &sAllocations.head },
+};
+
+/*****************************************************************************/
+
+static inline allocation** handleBucket(private_handle_t const* hnd)
+{
+    return &sAllocations.byHandle[
+            (uintptr_t(hnd) / sizeof(private_handle_t)) % ALLOCATION_BUCKETS];
+}
+
+/* Must be called with sAllocations.lock held. */
+static void removeLocked(allocation* a)
+{
+    allocation** pa = handleBucket(a->hnd);
+    for (; *pa; pa = &(*pa)->nextByHandle) {
+        if (*pa == a) {
+            *pa = a->nextByHandle;
+            break;
+        }
+    }
+    a->prev->next = a->next;
+    a->next->prev = a->prev;
+    sAllocations.count--;
+}
+
+/*****************************************************************************/
+
+void trackAllocation(alloc_device_t const* dev, private_handle_t* hnd)
+{
+    allocation* a = new allocation;
+    a->owner = dev;
+    a->hnd = hnd;
+    a->created = now_ns();
+
+    pthread_mutex_lock(&sAllocations.lock);
+    allocation* head = &sAllocations.head;
+    a->prev = head->prev;
+    a->next = head;
+    head->prev->next = a;
+    head->prev = a;
+    allocation** bucket = handleBucket(hnd);
+    a->nextByHandle = *bucket;
+    *bucket = a;
+    sAllocations.count++;
+    pthread_mutex_unlock(&sAllocations.lock);
+}
+
+bool untrackAllocation(private_handle_t const* hnd)
+{
+    allocation* found = NULL;
+
+    pthread_mutex_lock(&sAllocations.lock);
+    for (allocation* a = *handleBucket(hnd); a; a = a->nextByHandle) {
+        if (a->hnd == hnd) {
+            found = a;
+            removeLocked(a);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sAllocations.lock);
+
+    delete found;
+    return found != NULL;
+}
+
+private_handle_t* untrackAllocationOf(alloc_device_t const* dev)
+{
+    allocation* found = NULL;
+
+    pthread_mutex_lock(&sAllocations.lock);
+    allocation* head = &sAllocations.head;
+    for (allocation* a = head->next; a != head; a = a->next) {
+        if (a->owner == dev) {
+            found = a;
+            removeLocked(a);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sAllocations.lock);
+
+    if (!found)
+        return NULL;
+    private_handle_t* hnd = found->hnd;
+    delete found;
+    return hnd;
+}
+
+void dumpAllocations(char* buff, int buff_len)
+{
+    int pos = strlen(buff);
+    int64_t time = now_ns();
+    size_t total = 0;
+
+    pthread_mutex_lock(&sAllocations.lock);
+    appendf(buff, buff_len, &pos, "gralloc: %zu buffers allocated\n",
+            sAllocations.count);
+    appendf(buff, buff_len, &pos,
+            "  %-10s %10s %9s %8s %10s %6s %8s %4s\n",
+            "handle", "size", "w x h", "format", "usage", "pid",
+            "age (s)", "maps");
+    allocation* head = &sAllocations.head;
+    for (allocation* a = head->next; a != head; a = a->next) {
+        private_handle_t const* hnd = a->hnd;
+        total += hnd->size;
+        char dimensions[24];
+        snprintf(dimensions, sizeof(dimensions), "%dx%d",
+                hnd->width, hnd->height);
+        appendf(buff, buff_len, &pos,
+                "  %-10p %10d %9s %8x 0x%08x %6d %8lld %4d\n",
+                hnd, hnd->size, dimensions, hnd->format, hnd->usage,
+                hnd->pid, (long long)((time - a->created) / 1000000000LL),
+                getMappingCount(hnd));
+    }
+    pthread_mutex_unlock(&sAllocations.lock);
+    appendf(buff, buff_len, &pos, "  %zu bytes in total\n", total);
+
+    gralloc_pool_stats stats;
+    gralloc_pool_get_stats(&stats);
+    appendf(buff, buff_len, &pos,
+            "  pool: %zu buffers, %zu bytes, %llu hits, %llu misses, "
+            "%llu evictions\n",
+            stats.retainedBuffers, stats.retainedBytes,
+            (unsigned long long)stats.hits,
+            (unsigned long long)stats.misses,
+            (unsigned long long)stats.evictions);
+}
+
+int getAllocationMemory(pid_t pid, int type,
+        struct memtrack_record* records, size_t* num_records)
+{
+    if (type != MEMTRACK_TYPE_GRAPHICS)
+        return -ENODEV;
+
+    size_t count = *num_records;
+    *num_records = MEMTRACK_RECORDS;
+    if (count == 0)
+        return 0;
+
+    // The records can't be split by 'pid': the handles are created here,
+    // with the pid of this process, and which processes they are handed to
+    // isn't known. Every query gets the totals of this process.
+    //
+    // ashmem, memfd and dma-buf memory shows in smaps, the framebuffer,
+    // remapped by its driver, doesn't
+    size_t buffers = 0, framebuffer = 0;
+    pthread_mutex_lock(&sAllocations.lock);
+    allocation* head = &sAllocations.head;
+    for (allocation* a = head->next; a != head; a = a->next) {
+        private_handle_t const* hnd = a->hnd;
+        if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)
+            framebuffer += hnd->size;
+        else
+            buffers += hnd->size;
+    }
+    pthread_mutex_unlock(&sAllocations.lock);
+
+    const memtrack_record all[MEMTRACK_RECORDS] = {
+        { buffers, MEMTRACK_FLAG_SMAPS_ACCOUNTED | MEMTRACK_FLAG_SHARED |
+                MEMTRACK_FLAG_SYSTEM | MEMTRACK_FLAG_NONSECURE },
+        { framebuffer, MEMTRACK_FLAG_SMAPS_UNACCOUNTED | MEMTRACK_FLAG_SHARED |
+                MEMTRACK_FLAG_DEDICATED | MEMTRACK_FLAG_NONSECURE },
+    };
+    if (count > MEMTRACK_RECORDS)
+        count = MEMTRACK_RECORDS;
+    memcpy(records, all, count * sizeof(*records));
+    return 0;
+}
@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <cutils/ashmem.h>
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+/*
+ * The memory behind the buffers comes from the first of the backings listed
+ * in PROP_BACKING, comma separated, that works:
+ *
+ *  - "ashmem", the historical backing, only shared between processes,
+ *  - "memfd", sealed against resizing so that importers can trust the size,
+ *  - "dmabuf", allocated from the dma-buf heap PROP_DMA_HEAP, which V4L2
+ *    and DRM drivers can import without a copy.
+ *
+ * A backing that fails for lack of kernel support is skipped from then on.
+ *
+ * Buffers of PROP_HUGEPAGE_THRESHOLD bytes or more, 0 to disable, are
+ * rounded up to a whole number of huge pages, so as to be walked with a
+ * few TLB entries rather than thousands. When memfd is in the list, they
+ * are first allocated from hugetlbfs, and the huge pages are reserved up
+ * front so that a system without free huge pages fails the allocation
+ * rather than the first access. Otherwise they are flagged
+ * PRIV_FLAGS_HUGEPAGE so that mapBuffer() maps them huge page aligned and
+ * asks for transparent huge pages, which the kernel may or may not grant.
+ */
+#define PROP_BACKING        "ro.gralloc.backing"
+#define PROP_DMA_HEAP       "ro.gralloc.dma_heap"
+#define PROP_HUGEPAGE_THRESHOLD "ro.gralloc.hugepage_threshold"
+
+#if HAVE_ANDROID_OS
+#define DEFAULT_BACKING     "ashmem,memfd"
+#else
+#define DEFAULT_BACKING     "memfd,ashmem"
+#endif
+#define DEFAULT_DMA_HEAP    "/dev/dma_heap/system"
+#define DEFAULT_HUGEPAGE_THRESHOLD  (4 * 1024 * 1024)
+#define DEFAULT_HUGEPAGE_SIZE       (2 * 1024 * 1024)
+
+#define MAX_BACKINGS        3
+
+// memfd and dma-buf definitions missing from older kernel headers
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC         0x0001U
+#define MFD_ALLOW_SEALING   0x0002U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB         0x0004U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS         (1024 + 9)
+#define F_SEAL_SEAL         0x0001
+#define F_SEAL_SHRINK       0x0002
+#define F_SEAL_GROW         0x0004
+#endif
+#ifndef KCMP_FILE
+#define KCMP_FILE           0
+#endif
+
+struct dma_heap_allocation {
+    uint64_t len;
+    uint32_t fd;
+    uint32_t fd_flags;
+    uint64_t heap_flags;
+};
+#define DMA_HEAP_ALLOC      _IOWR('H', 0x0, struct dma_heap_allocation)
+
+struct dma_buf_sync_args {
+    uint64_t flags;
+};
+#define DMA_BUF_SYNC        _IOW('b', 0, struct dma_buf_sync_args)
+#define DMA_BUF_SYNC_RW     (1 << 0 | 1 << 1)
+#define DMA_BUF_SYNC_START  (0 << 2)
+#define DMA_BUF_SYNC_END    (1 << 2)
+
+struct backing_allocator {
+    const char* name;
+    int type;
+    // returns a file descriptor of a 'size' bytes buffer, or -errno
+    int (*allocate)(size_t size);
+};
+
+struct backing_state {
+    pthread_once_t once;
+    const backing_allocator* order[MAX_BACKINGS];
+    // set once an allocator turns out to be unsupported, by any thread
+    volatile int32_t disabled[MAX_BACKINGS];
+    size_t count;
+    int dmaHeapFd;
+    size_t hugePageThreshold;
+    size_t hugePageSize;
+    volatile int32_t hugetlbDisabled;
+    volatile int32_t serial;
+    pthread_once_t kcmpOnce;
+    bool kcmpSupported;
+};
+
+static backing_state sBacking = {
+    once: PTHREAD_ONCE_INIT,
+    kcmpOnce: PTHREAD_ONCE_INIT,
+};
+
+/*****************************************************************************/
+
+static int ashmemAllocate(size_t size)
+{
+    int fd = ashmem_create_region("gralloc-buffer", size);
+    return fd < 0 ? -errno : fd;
+}
+
+static int memfdCreate(size_t size, unsigned int flags)
+{
+#ifdef __NR_memfd_create
+    int fd = syscall(__NR_memfd_create, "gralloc-buffer",
+            MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+    if (fd < 0)
+        return -errno;
+    if (ftruncate(fd, size) < 0 ||
+            // reserve the huge pages now, they may be short
+            ((flags & MFD_HUGETLB) && fallocate(fd, 0, 0, size) < 0) ||
+            fcntl(fd, F_ADD_SEALS,
+                  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    return fd;
+#else
+    return -ENOSYS;
+#endif
+}
+
+static int memfdAllocate(size_t size)
+{
+    return memfdCreate(size, 0);
+}
+
+static int dmabufAllocate(size_t size)
+{
+    if (sBacking.dmaHeapFd < 0)
+        return -ENODEV;
+    dma_heap_allocation data;
+    memset(&data, 0, sizeof(data));
+    data.len = size;
+    data.fd_flags = O_RDWR | O_CLOEXEC;
+    if (ioctl(sBacking.dmaHeapFd, DMA_HEAP_ALLOC, &data) < 0)
+        return -errno;
+    return data.fd;
+}
+
+static const backing_allocator sAllocators[] = {
+    { "ashmem", private_handle_t::BACKING_ASHMEM, ashmemAllocate },
+    { "memfd", private_handle_t::BACKING_MEMFD, memfdAllocate },
+    { "dmabuf", private_handle_t::BACKING_DMABUF, dmabufAllocate },
+};
+
+static size_t readHugePageSize()
+{
+    size_t size = DEFAULT_HUGEPAGE_SIZE;
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[128];
+        unsigned long kb;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+                size = kb * 1024;
+                break;
+            }
+        }
+        fclose(f);
+    }
+    return size;
+}
+
+static void backingInit()
+{
+    char value[PROPERTY_VALUE_MAX];
+    property_get(PROP_BACKING, value, DEFAULT_BACKING);
+
+    char* saveptr;
+    for (char* name = strtok_r(value, ",", &saveptr); name;
+            name = strtok_r(NULL, ",", &saveptr)) {
+        const backing_allocator* allocator = NULL;
+        for (size_t i = 0; i < sizeof(sAllocators) / sizeof(*sAllocators);
+                i++) {
+            if (!strcmp(name, sAllocators[i].name))
+                allocator = &sAllocators[i];
+        }
+        if (!allocator) {
+            ALOGW("ignoring unknown backing %s", name);
+            continue;
+        }
+        if (sBacking.count < MAX_BACKINGS)
+            sBacking.order[sBacking.count++] = allocator;
+    }
+    if (sBacking.count == 0)
+        sBacking.order[sBacking.count++] = &sAllocators[0];
+
+    sBacking.dmaHeapFd = -1;
+    for (size_t i = 0; i < sBacking.count; i++) {
+        if (sBacking.order[i]->type == private_handle_t::BACKING_DMABUF) {
+            property_get(PROP_DMA_HEAP, value, DEFAULT_DMA_HEAP);
+            sBacking.dmaHeapFd = open(value, O_RDONLY | O_CLOEXEC);
+            ALOGW_IF(sBacking.dmaHeapFd < 0, "cannot open %s (%s)", value,
+                    strerror(errno));
+        }
+    }
+
+    sBacking.hugePageThreshold = getLongProperty(PROP_HUGEPAGE_THRESHOLD,
+            DEFAULT_HUGEPAGE_THRESHOLD);
+    sBacking.hugePageSize = readHugePageSize();
+}
+
+static bool isMemfdEnabled()
+{
+    for (size_t i = 0; i < sBacking.count; i++) {
+        if (sBacking.order[i]->type == private_handle_t::BACKING_MEMFD)
+            return !android_atomic_acquire_load(&sBacking.disabled[i]);
+    }
+    return false;
+}
+
+// Try to allocate a buffer from hugetlbfs, returns -errno if there is none.
+static int hugetlbAllocate(size_t size)
+{
+    if (android_atomic_acquire_load(&sBacking.hugetlbDisabled) ||
+            !isMemfdEnabled())
+        return -ENOSYS;
+    int fd = memfdCreate(size, MFD_HUGETLB);
+    if (fd == -EINVAL || fd == -ENOSYS || fd == -EOPNOTSUPP) {
+        // no hugetlbfs, or memfd can't use it: don't try again
+        ALOGW("hugetlb memfd not supported (%s)", strerror(-fd));
+        android_atomic_release_store(1, &sBacking.hugetlbDisabled);
+    }
+    return fd;
+}
+
+/*****************************************************************************/
+
+size_t getBackingSize(size_t size)
+{
+    pthread_once(&sBacking.once, backingInit);
+    if (!sBacking.hugePageThreshold || size < sBacking.hugePageThreshold)
+        return size;
+    size_t mask = sBacking.hugePageSize - 1;
+    return (size + mask) & ~mask;
+}
+
+size_t getHugePageSize()
+{
+    pthread_once(&sBacking.once, backingInit);
+    return sBacking.hugePageSize;
+}
+
+int allocateBacking(size_t size, int* type, int* flags)
+{
+    pthread_once(&sBacking.once, backingInit);
+
+    *flags = 0;
+    bool huge = sBacking.hugePageThreshold &&
+            size >= sBacking.hugePageThreshold;
+    if (huge) {
+        int fd = hugetlbAllocate(size);
+        if (fd >= 0) {
+            *type = private_handle_t::BACKING_MEMFD;
+            return fd;
+        }
+    }
+
+    int err = -ENOSYS;
+    for (size_t i = 0; i < sBacking.count; i++) {
+        if (android_atomic_acquire_load(&sBacking.disabled[i]))
+            continue;
+        const backing_allocator* allocator = sBacking.order[i];
+        int fd = allocator->allocate(size);
+        if (fd >= 0) {
+            *type = allocator->type;
+            if (huge && allocator->type != private_handle_t::BACKING_DMABUF)
+                *flags = private_handle_t::PRIV_FLAGS_HUGEPAGE;
+            return fd;
+        }
+        err = fd;
+        if (err == -ENOSYS || err == -ENODEV || err == -ENOENT) {
+            ALOGW("%s not supported (%s), not using it anymore",
+                    allocator->name, strerror(-err));
+            android_atomic_release_store(1, &sBacking.disabled[i]);
+        } else {
+            ALOGE("couldn't create %s buffer (%s)", allocator->name,
+                    strerror(-err));
+        }
+    }
+    return err;
+}
+
+int nextBufferId()
+{
+    return android_atomic_inc(&sBacking.serial);
+}
+
+/*
+ * Only memfd buffers, regular files, are sure to have an inode of their
+ * own: ashmem regions all share the inode of /dev/ashmem, and so do
+ * dma-bufs on older kernels. Those can't be told apart by anything in the
+ * handle, which the client sets, but only by comparing the open files behind
+ * two file descriptors with kcmp(). Without kcmp(), which needs
+ * CONFIG_CHECKPOINT_RESTORE, each of their handles gets its own mapping.
+ */
+static int compareFiles(int fd1, int fd2)
+{
+#ifdef __NR_kcmp
+    pid_t pid = getpid();
+    int ret = syscall(__NR_kcmp, pid, pid, KCMP_FILE, fd1, fd2);
+    return ret < 0 ? -errno : ret;
+#else
+    return -ENOSYS;
+#endif
+}
+
+static void kcmpInit()
+{
+    int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int ret = fd < 0 ? -errno : compareFiles(fd, fd);
+    if (fd >= 0)
+        close(fd);
+    sBacking.kcmpSupported = ret == 0;
+    ALOGW_IF(ret != 0, "kcmp not available (%s), ashmem buffers won't share "
+            "their mappings", strerror(-ret));
+}
+
+int getBufferKey(private_handle_t const* hnd, buffer_key* key)
+{
+    struct stat st;
+    if (fstat(hnd->fd, &st) < 0)
+        return -errno;
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->pid = 0;
+    key->id = 0;
+    key->match = buffer_key::UNIQUE;
+    if (!S_ISREG(st.st_mode)) {
+        pthread_once(&sBacking.kcmpOnce, kcmpInit);
+        key->pid = hnd->pid;
+        key->id = hnd->id;
+        key->match = sBacking.kcmpSupported ? buffer_key::CHECK_FILE :
+                buffer_key::NONE;
+    }
+    return 0;
+}
+
+bool isSameBufferFile(int fd1, int fd2)
+{
+    return compareFiles(fd1, fd2) == 0;
+}
+
+void syncBacking(private_handle_t const* hnd, bool start)
+{
+    // let the exporter maintain the caches around the CPU access
+    if (hnd->backing == private_handle_t::BACKING_DMABUF) {
+        dma_buf_sync_args sync;
+        sync.flags = DMA_BUF_SYNC_RW |
+                (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END);
+        if (ioctl(hnd->fd, DMA_BUF_SYNC, &sync) < 0)
+            ALOGW("DMA_BUF_IOCTL_SYNC failed (%s)", strerror(errno));
+    }
+}
@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <cutils/log.h>
+
+#include "gr.h"
+
+/*****************************************************************************/
+
+/*
+ * Software blits used by fb_post() when the framebuffer can't flip pages.
+ *
+ * Rows of the same layout are copied with memcpy(), or with non-temporal
+ * stores where available when the rectangle is larger than
+ * NON_TEMPORAL_THRESHOLD bytes, so that a full screen copy doesn't evict
+ * the whole cache only to write to memory that is never read back by the
+ * CPU. Rows of 32-bit pixels are converted to RGB_565 with NEON or SSE2
+ * kernels, the other conversions are plain C.
+ */
+
+#define NON_TEMPORAL_THRESHOLD  (256 * 1024)
+
+// Pixel layouts, the alpha channel of 32-bit formats is ignored.
+enum {
+    LAYOUT_UNKNOWN,
+    LAYOUT_RGBX_8888,
+    LAYOUT_BGRX_8888,
+    LAYOUT_RGB_888,
+    LAYOUT_RGB_565,
+};
+
+typedef void (*blit_row_t)(uint8_t* dst, const uint8_t* src, size_t count);
+
+static int getLayout(int format)
+{
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+            return LAYOUT_RGBX_8888;
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            return LAYOUT_BGRX_8888;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            return LAYOUT_RGB_888;
+        case HAL_PIXEL_FORMAT_RGB_565:
+            return LAYOUT_RGB_565;
+    }
+    return LAYOUT_UNKNOWN;
+}
+
+static size_t getBytesPerPixel(int layout)
+{
+    switch (layout) {
+        case LAYOUT_RGBX_8888:
+        case LAYOUT_BGRX_8888:
+            return 4;
+        case LAYOUT_RGB_888:
+            return 3;
+        case LAYOUT_RGB_565:
+            return 2;
+    }
+    return 0;
+}
+
+/*****************************************************************************/
+
+static void copyRowNonTemporal(uint8_t* dst, const uint8_t* src, size_t size)
+{
+#if defined(__SSE2__)
+    size_t head = (16 - (uintptr_t(dst) & 15)) & 15;
+    if (head > size)
+        head = size;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+    for (; size >= 64; size -= 64, dst += 64, src += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+        _mm_stream_si128((__m128i*)(dst), a);
+        _mm_stream_si128((__m128i*)(dst + 16), b);
+        _mm_stream_si128((__m128i*)(dst + 32), c);
+        _mm_stream_si128((__m128i*)(dst + 48), d);
+    }
+#endif
+    // NEON has no non-temporal stores, memcpy() is as good as it gets
+    memcpy(dst, src, size);
+}
+
+static inline uint16_t pack565(uint32_t r, uint32_t g, uint32_t b)
+{
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+// 'red' is the index of the red byte of the source pixels, 0 or 2
+template<int red>
+static void convert8888To565(uint8_t* dst, const uint8_t* src, size_t count)
+{
+    uint16_t* d = (uint16_t*)dst;
+#if defined(__ARM_NEON__)
+    for (; count >= 8; count -= 8, d += 8, src += 32) {
+        uint8x8x4_t p = vld4_u8(src);
+        uint16x8_t r = vshll_n_u8(p.val[red], 8);
+        uint16x8_t g = vshll_n_u8(p.val[1], 8);
+        uint16x8_t b = vshll_n_u8(p.val[2 - red], 8);
+        uint16x8_t out = vsriq_n_u16(r, g, 5);
+        out = vsriq_n_u16(out, b, 11);
+        vst1q_u16(d, out);
+    }
+#elif defined(__SSE2__)
+    const int redShift = red * 8;
+    const int blueShift = (2 - red) * 8;
+    const __m128i redMask = _mm_set1_epi32(0xf8 << redShift);
+    const __m128i greenMask = _mm_set1_epi32(0xfc00);
+    const __m128i blueMask = _mm_set1_epi32(0xf8 << blueShift);
+    for (; count >= 8; count -= 8, d += 8, src += 32) {
+        __m128i out[2];
+        for (int i = 0; i < 2; i++) {
+            __m128i p = _mm_loadu_si128((const __m128i*)(src + i * 16));
+            __m128i r = _mm_and_si128(p, redMask);
+            __m128i g = _mm_and_si128(p, greenMask);
+            __m128i b = _mm_and_si128(p, blueMask);
+            // shift counts must be immediates
+            r = red ? _mm_srli_epi32(r, 8) : _mm_slli_epi32(r, 8);
+            b = red ? _mm_srli_epi32(b, 3) : _mm_srli_epi32(b, 19);
+            __m128i v = _mm_or_si128(_mm_or_si128(r, _mm_srli_epi32(g, 5)), b);
+            // sign extend so that the signed saturation of packs is a no-op
+            out[i] = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+        }
+        _mm_storeu_si128((__m128i*)d, _mm_packs_epi32(out[0], out[1]));
+    }
+#endif
+    for (; count > 0; count--, d++, src += 4)
+        *d = pack565(src[red], src[1], src[2 - red]);
+}
+
+template<int red>
+static void convert565To8888(uint8_t* dst, const uint8_t* src, size_t count)
+{
+    const uint16_t* s = (const uint16_t*)src;
+    for (; count > 0; count--, s++, dst += 4) {
+        uint32_t p = *s;
+        uint32_t r = (p >> 11) & 0x1f;
+        uint32_t g = (p >> 5) & 0x3f;
+        uint32_t b = p & 0x1f;
+        dst[red] = (r << 3) | (r >> 2);
+        dst[1] = (g << 2) | (g >> 4);
+        dst[2 - red] = (b << 3) | (b >> 2);
+        dst[3] = 0xff;
+    }
+}
+
+static void swapRedBlue8888(uint8_t* dst, const uint8_t* src, size_t count)
+{
+    const uint32_t* s = (const uint32_t*)src;
+    uint32_t* d = (uint32_t*)dst;
+    for (; count > 0; count--) {
+        uint32_t p = *s++;
+        *d++ = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+    }
+}
+
+template<int red>
+static void convert888To8888(uint8_t* dst, const uint8_t* src, size_t count)
+{
+    for (; count > 0; count--, src += 3, dst += 4) {
+        dst[red] = src[0];
+        dst[1] = src[1];
+        dst[2 - red] = src[2];
+        dst[3] = 0xff;
+    }
+}
+
+static void convert888To565(uint8_t* dst, const uint8_t* src, size_t count)
+{
+    uint16_t* d = (uint16_t*)dst;
+    for (; count > 0; count--, src += 3)
+        *d++ = pack565(src[0], src[1], src[2]);
+}
+
+static blit_row_t getConversion(int dstLayout, int srcLayout)
+{
+    switch (dstLayout) {
+        case LAYOUT_RGB_565:
+            switch (srcLayout) {
+                case LAYOUT_RGBX_8888: return convert8888To565<0>;
+                case LAYOUT_BGRX_8888: return convert8888To565<2>;
+                case LAYOUT_RGB_888:   return convert888To565;
+            }
+            break;
+        case LAYOUT_RGBX_8888:
+            switch (srcLayout) {
+                case LAYOUT_BGRX_8888: return swapRedBlue8888;
+                case LAYOUT_RGB_565:   return convert565To8888<0>;
+                case LAYOUT_RGB_888:   return convert888To8888<0>;
+            }
+            break;
+        case LAYOUT_BGRX_8888:
+            switch (srcLayout) {
+                case LAYOUT_RGBX_8888: return swapRedBlue8888;
+                case LAYOUT_RGB_565:   return convert565To8888<2>;
+                case LAYOUT_RGB_888:   return convert888To8888<2>;
+            }
+            break;
+    }
+    return NULL;
+}
+
+/*****************************************************************************/
+
+size_t bytesPerPixel(int format)
+{
+    return getBytesPerPixel(getLayout(format));
+}
+
+int blitRect(void* dst, int dstFormat, size_t dstStride,
+        const void* src, int srcFormat, size_t srcStride,
+        const blit_rect& rect)
+{
+    int dstLayout = getLayout(dstFormat);
+    int srcLayout = getLayout(srcFormat);
+    if (dstLayout == LAYOUT_UNKNOWN || srcLayout == LAYOUT_UNKNOWN)
+        return -EINVAL;
+    if (rect.r <= rect.l || rect.b <= rect.t)
+        return 0;
+
+    size_t dstBpp = getBytesPerPixel(dstLayout);
+    size_t srcBpp = getBytesPerPixel(srcLayout);
+    size_t width = rect.r - rect.l;
+    uint8_t* d = (uint8_t*)dst + rect.t * dstStride + rect.l * dstBpp;
+    const uint8_t* s = (const uint8_t*)src + rect.t * srcStride +
+            rect.l * srcBpp;
+
+    if (dstLayout == srcLayout) {
+        size_t rowSize = width * dstBpp;
+        if (rowSize == dstStride && rowSize == srcStride) {
+            // contiguous rows, copy them all at once
+            rowSize *= rect.b - rect.t;
+            if (rowSize >= NON_TEMPORAL_THRESHOLD)
+                copyRowNonTemporal(d, s, rowSize);
+            else
+                memcpy(d, s, rowSize);
+        } else if (rowSize * (rect.b - rect.t) >= NON_TEMPORAL_THRESHOLD) {
+            for (int y = rect.t; y < rect.b; y++, d += dstStride, s += srcStride)
+                copyRowNonTemporal(d, s, rowSize);
+        } else {
+            for (int y = rect.t; y < rect.b; y++, d += dstStride, s += srcStride)
+                memcpy(d, s, rowSize);
+        }
+#if defined(__SSE2__)
+        // order the non-temporal stores before the framebuffer is scanned out
+        _mm_sfence();
+#endif
+        return 0;
+    }
+
+    blit_row_t convert = getConversion(dstLayout, srcLayout);
+    if (convert == NULL)
+        return -EINVAL;
+    for (int y = rect.t; y < rect.b; y++, d += dstStride, s += srcStride)
+        convert(d, s, width);
+    return 0;
+}
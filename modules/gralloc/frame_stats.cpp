@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/atomic.h>
+
+#include "gr.h"
+
+/*****************************************************************************/
+
+/*
+ * Each record is guarded by a sequence number, odd while the record is
+ * being written, so that frameStatsDump() can skip the records that change
+ * under it instead of blocking the writers.
+ */
+
+static int compareInt64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int64_t percentile(const int64_t* sorted, size_t count, int p)
+{
+    return sorted[(count - 1) * p / 100];
+}
+
+// Append the percentiles of the non-zero 'values', in microseconds.
+static void appendPercentiles(char* buff, int buff_len, int* pos,
+        const char* name, int64_t* values, size_t count)
+{
+    qsort(values, count, sizeof(*values), compareInt64);
+    size_t zeros = 0;
+    while (zeros < count && values[zeros] == 0)
+        zeros++;
+    values += zeros;
+    count -= zeros;
+    if (count == 0)
+        return;
+    appendf(buff, buff_len, pos,
+            "    %-12s %8lld %8lld %8lld %8lld\n", name,
+            (long long)(percentile(values, count, 50) / 1000),
+            (long long)(percentile(values, count, 90) / 1000),
+            (long long)(percentile(values, count, 99) / 1000),
+            (long long)(values[count - 1] / 1000));
+}
+
+/*****************************************************************************/
+
+void frameStatsRecord(frame_stats* stats, const frame_timing& timing)
+{
+    int32_t index = android_atomic_inc(&stats->next) & (FRAME_STATS_SIZE - 1);
+    frame_record& r = stats->records[index];
+    android_atomic_inc(&r.seq);
+    r.timing = timing;
+    android_atomic_inc(&r.seq);
+}
+
+void frameStatsDump(frame_stats* stats, int64_t vsyncPeriod,
+        char* buff, int buff_len)
+{
+    int64_t intervals[FRAME_STATS_SIZE];
+    int64_t flips[FRAME_STATS_SIZE];
+    int64_t blits[FRAME_STATS_SIZE];
+    // frames shown after 1, 2, 3 and 4 or more refresh periods
+    size_t vsyncs[4] = { 0, 0, 0, 0 };
+    size_t count = 0, missedFrames = 0, missedVsyncs = 0;
+    int pos = strlen(buff);
+
+    for (size_t i = 0; i < FRAME_STATS_SIZE; i++) {
+        frame_record& r = stats->records[i];
+        int32_t seq = android_atomic_acquire_load(&r.seq);
+        if (seq == 0 || (seq & 1))
+            continue;
+        frame_timing timing = r.timing;
+        android_memory_barrier();
+        if (r.seq != seq)
+            continue;
+
+        intervals[count] = timing.interval;
+        flips[count] = timing.flip;
+        blits[count] = timing.blit;
+        count++;
+        if (timing.missedVsyncs) {
+            missedFrames++;
+            missedVsyncs += timing.missedVsyncs;
+        }
+        if (timing.interval && vsyncPeriod) {
+            int64_t n = (timing.interval + vsyncPeriod / 2) / vsyncPeriod;
+            vsyncs[n < 1 ? 0 : (n > 4 ? 3 : n - 1)]++;
+        }
+    }
+
+    appendf(buff, buff_len, &pos, "  %u frames posted, last %zu:\n",
+            (uint32_t)stats->next, count);
+    if (count == 0)
+        return;
+    appendf(buff, buff_len, &pos,
+            "    %-12s %8s %8s %8s %8s (us)\n",
+            "", "p50", "p90", "p99", "max");
+    appendPercentiles(buff, buff_len, &pos, "interval", intervals, count);
+    appendPercentiles(buff, buff_len, &pos, "flip ioctl", flips, count);
+    appendPercentiles(buff, buff_len, &pos, "blit", blits, count);
+    appendf(buff, buff_len, &pos,
+            "    shown after 1/2/3/4+ vsyncs: %zu/%zu/%zu/%zu\n",
+            vsyncs[0], vsyncs[1], vsyncs[2], vsyncs[3]);
+    appendf(buff, buff_len, &pos,
+            "    %zu frames missed %zu vsyncs\n", missedFrames, missedVsyncs);
+}
@@ -29,21 +29,41 @@
 #include <sys/ioctl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 
 #if HAVE_ANDROID_OS
 #include <linux/fb.h>
 #endif
 
+#ifndef FBIO_WAITFORVSYNC
+#define FBIO_WAITFORVSYNC _IOW('F', 0x20, __u32)
+#endif
+
 #include "gralloc_priv.h"
 #include "gr.h"
 
 /*****************************************************************************/
 
-// numbers of buffers for page flipping
-#define NUM_BUFFERS 2
+// maximum number of buffers for page flipping, at most MAX_FRAMEBUFFERS
+#define PROP_MAX_BUFFERS        "ro.gralloc.fb.max_buffers"
+#define DEFAULT_MAX_BUFFERS     3
+
+/*
+ * Buffering depth: 2 makes fb_post() wait for the flip of the buffer it
+ * posted, 3 lets it return as soon as the buffer is queued, 0 picks one at
+ * runtime from the time spent rendering between posts. Double buffering has
+ * one frame less latency, but triple buffering keeps up with frames that
+ * take nearly a refresh period, or longer.
+ *
+ * 2 also limits the framebuffer to 2 buffers, with or without the flip
+ * queue. Without the flip queue fb_post() always waits for the flip, so 3
+ * and 0 only take effect with PROP_FLIP_QUEUE.
+ */
+#define PROP_BUFFERING          "ro.gralloc.fb.buffering"
 
 
 enum {
@@ -51,19 +71,278 @@ enum {
     LOCKED = 0x00000002
 };
 
+// info.reserved[0] when fb_setUpdateRect() stored a rectangle
+#define UPDATE_RECT_MAGIC   0x54445055 // "UPDT"
+
+/*
+ * When PROP_FLIP_QUEUE is set, fb_post() hands framebuffer buffers to a
+ * flip thread and returns without waiting for the flip. The thread waits
+ * for the vsync at which the buffer is due, using FBIO_WAITFORVSYNC, or a
+ * timer at the refresh rate if the driver doesn't support it, then pans
+ * the display to the buffer.
+ *
+ * At most one buffer is queued: fb_post() waits for the previous one to be
+ * flipped, except with a swap interval of 0 where the queued buffer is
+ * replaced and counted as dropped.
+ *
+ * Buffers are released when fb_post() returns: the buffer posted and the
+ * one posted just before may still be queued or on screen, but every other
+ * buffer is off screen and can be rendered into. When a queued buffer was
+ * dropped, the one still on screen is older than that, so fb_post() then
+ * waits for the flip of the buffer it posted. This takes 3 buffers, or 2
+ * with double buffering where fb_post() waits for every flip anyway.
+ */
+#define PROP_FLIP_QUEUE     "ro.gralloc.flip_queue"
+
+// number of flips between two logs of the late and dropped frames
+#define FLIP_STATS_PERIOD   600
+
+// number of posts whose updated rectangles are kept, see getBufferDamage()
+#define DAMAGE_HISTORY      4
+
+struct posted_rect {
+    intptr_t buffer;
+    blit_rect rect;
+};
+
+struct flip_queue {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+    buffer_handle_t pending;
+    // the last buffer posted, see queueFlip()
+    buffer_handle_t posted;
+    int64_t postTime;
+    frame_timing timing;
+    int64_t lastFlip;
+    uint64_t flips;
+    uint64_t late;
+    uint64_t dropped;
+};
+
 struct fb_context_t {
     framebuffer_device_t  device;
+    int swapInterval;
+    bool waitForVsyncSupported;
+    int64_t vsyncPeriod;
+    bool flipQueueEnabled;
+    flip_queue queue;
+    // 2 or 3, see PROP_BUFFERING
+    int buffering;
+    bool autoBuffering;
+    int64_t lastPostEnd;
+    int64_t renderTime;
+    int64_t lastPost;
+    frame_stats stats;
+    // rectangles updated by the last posts without page flipping, the
+    // most recent first
+    posted_rect damage[DAMAGE_HISTORY];
+    int damageCount;
 };
 
 /*****************************************************************************/
 
+/*
+ * Wait for the next vsync, returns its time. Falls back to sleeping until
+ * the next multiple of the refresh period if the driver can't wait.
+ */
+static int64_t waitForVsync(fb_context_t* ctx, private_module_t* m)
+{
+    if (ctx->waitForVsyncSupported) {
+        uint32_t crtc = 0;
+        if (ioctl(m->framebuffer->fd, FBIO_WAITFORVSYNC, &crtc) == 0)
+            return now_ns();
+        if (errno != EINTR) {
+            ALOGW("FBIO_WAITFORVSYNC failed (%s), using a timer",
+                    strerror(errno));
+            ctx->waitForVsyncSupported = false;
+        }
+    }
+
+    int64_t now = now_ns();
+    int64_t next = now + ctx->vsyncPeriod - now % ctx->vsyncPeriod;
+    struct timespec ts;
+    ts.tv_sec = next / 1000000000LL;
+    ts.tv_nsec = next % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+    return next;
+}
+
+static int flipTo(private_module_t* m, buffer_handle_t buffer, int activate)
+{
+    private_handle_t const* hnd =
+            reinterpret_cast<private_handle_t const*>(buffer);
+    const size_t offset = hnd->base - m->framebuffer->base;
+    m->info.activate = activate;
+    m->info.yoffset = offset / m->finfo.line_length;
+    if (ioctl(m->framebuffer->fd, FBIOPUT_VSCREENINFO, &m->info) == -1) {
+        ALOGE("FBIOPUT_VSCREENINFO failed");
+        return -errno;
+    }
+    m->currentBuffer = buffer;
+    return 0;
+}
+
+static void* flipThread(void* arg)
+{
+    fb_context_t* ctx = (fb_context_t*)arg;
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            ctx->device.common.module);
+    flip_queue& q = ctx->queue;
+
+    pthread_mutex_lock(&q.lock);
+    while (true) {
+        while (q.running && !q.pending)
+            pthread_cond_wait(&q.cond, &q.lock);
+        if (!q.running)
+            break;
+        int interval = ctx->swapInterval;
+        int64_t postTime = q.postTime;
+        pthread_mutex_unlock(&q.lock);
+
+        // wait until 'interval' refresh periods passed since the last flip,
+        // allowing for half a period of jitter
+        int64_t flipTime = now_ns();
+        int64_t due = q.lastFlip + interval * ctx->vsyncPeriod -
+                ctx->vsyncPeriod / 2;
+        if (interval > 0) {
+            do {
+                flipTime = waitForVsync(ctx, m);
+            } while (flipTime < due);
+        }
+
+        pthread_mutex_lock(&q.lock);
+        // with a swap interval of 0, a newer buffer may have replaced it
+        buffer_handle_t buffer = q.pending;
+        frame_timing timing = q.timing;
+        int64_t start = now_ns();
+        int err = flipTo(m, buffer, FB_ACTIVATE_NOW);
+        timing.flip = now_ns() - start;
+        frameStatsRecord(&ctx->stats, timing);
+        if (err == 0) {
+            // late if it missed the first vsync it could have been shown at
+            int64_t target = due > postTime ? due : postTime;
+            if (interval > 0 && flipTime - target > ctx->vsyncPeriod)
+                q.late++;
+            q.flips++;
+            if (q.flips % FLIP_STATS_PERIOD == 0 && (q.late || q.dropped)) {
+                ALOGI("%llu flips, %llu late, %llu dropped",
+                        (unsigned long long)q.flips,
+                        (unsigned long long)q.late,
+                        (unsigned long long)q.dropped);
+            }
+        }
+        q.lastFlip = flipTime;
+        q.pending = 0;
+        // release the buffer that was on screen to fb_post()
+        pthread_cond_broadcast(&q.cond);
+    }
+    pthread_mutex_unlock(&q.lock);
+    return NULL;
+}
+
+static void startFlipQueue(fb_context_t* ctx)
+{
+    flip_queue& q = ctx->queue;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+    q.running = true;
+    if (pthread_create(&q.thread, NULL, flipThread, ctx) != 0) {
+        ALOGE("cannot create the flip thread, flipping synchronously");
+        pthread_cond_destroy(&q.cond);
+        pthread_mutex_destroy(&q.lock);
+        return;
+    }
+    ctx->flipQueueEnabled = true;
+}
+
+static void stopFlipQueue(fb_context_t* ctx)
+{
+    flip_queue& q = ctx->queue;
+    pthread_mutex_lock(&q.lock);
+    // let the thread flip the last buffer posted
+    while (q.pending)
+        pthread_cond_wait(&q.cond, &q.lock);
+    q.running = false;
+    pthread_cond_broadcast(&q.cond);
+    pthread_mutex_unlock(&q.lock);
+    pthread_join(q.thread, NULL);
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
+    ctx->flipQueueEnabled = false;
+}
+
+/*
+ * Switch between double and triple buffering from the average time spent
+ * rendering between posts, with some hysteresis.
+ */
+static void updateBuffering(fb_context_t* ctx, int64_t renderTime)
+{
+    // exponential moving average over about 8 frames
+    if (ctx->renderTime)
+        ctx->renderTime += (renderTime - ctx->renderTime) / 8;
+    else
+        ctx->renderTime = renderTime;
+
+    int buffering = ctx->buffering;
+    if (ctx->renderTime > ctx->vsyncPeriod * 3 / 4)
+        buffering = 3;
+    else if (ctx->renderTime < ctx->vsyncPeriod / 2)
+        buffering = 2;
+    if (buffering != ctx->buffering) {
+        ALOGD("render time %lld us, switching to %s buffering",
+                (long long)(ctx->renderTime / 1000),
+                buffering == 3 ? "triple" : "double");
+        ctx->buffering = buffering;
+    }
+}
+
+static int queueFlip(fb_context_t* ctx, buffer_handle_t buffer,
+        const frame_timing& timing)
+{
+    flip_queue& q = ctx->queue;
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            ctx->device.common.module);
+    int64_t start = now_ns();
+    if (ctx->autoBuffering && ctx->lastPostEnd)
+        updateBuffering(ctx, start - ctx->lastPostEnd);
+
+    pthread_mutex_lock(&q.lock);
+    if (q.pending && ctx->swapInterval == 0) {
+        q.dropped++;
+    } else {
+        while (q.pending)
+            pthread_cond_wait(&q.cond, &q.lock);
+    }
+    buffer_handle_t previous = q.posted;
+    q.pending = buffer;
+    q.posted = buffer;
+    q.postTime = start;
+    q.timing = timing;
+    pthread_cond_broadcast(&q.cond);
+    // With double buffering, wait until it is flipped. Otherwise only wait
+    // if the buffer on screen isn't the previous one, because it replaced a
+    // dropped buffer: the buffer on screen is about to be released.
+    while (q.pending == buffer &&
+            (ctx->buffering == 2 || m->currentBuffer != previous))
+        pthread_cond_wait(&q.cond, &q.lock);
+    pthread_mutex_unlock(&q.lock);
+
+    ctx->lastPostEnd = now_ns();
+    return 0;
+}
+
+/*****************************************************************************/
+
 static int fb_setSwapInterval(struct framebuffer_device_t* dev,
             int interval)
 {
     fb_context_t* ctx = (fb_context_t*)dev;
     if (interval < dev->minSwapInterval || interval > dev->maxSwapInterval)
         return -EINVAL;
-    // FIXME: implement fb_setSwapInterval
+    ctx->swapInterval = interval;
     return 0;
 }
 
@@ -76,12 +355,96 @@ static int fb_setUpdateRect(struct framebuffer_device_t* dev,
     fb_context_t* ctx = (fb_context_t*)dev;
     private_module_t* m = reinterpret_cast<private_module_t*>(
             dev->common.module);
-    m->info.reserved[0] = 0x54445055; // "UPDT";
+    m->info.reserved[0] = UPDATE_RECT_MAGIC;
     m->info.reserved[1] = (uint16_t)l | ((uint32_t)t << 16);
     m->info.reserved[2] = (uint16_t)(l+w) | ((uint32_t)(t+h) << 16);
     return 0;
 }
 
+static int getFramebufferFormat(private_module_t const* m)
+{
+    return (m->info.bits_per_pixel == 32)
+            ? HAL_PIXEL_FORMAT_RGBX_8888
+            : HAL_PIXEL_FORMAT_RGB_565;
+}
+
+/*
+ * Get the area of the screen to update: the rectangle set by
+ * fb_setUpdateRect() since the last post if any, clipped to the screen,
+ * or the whole screen. Returns false in the latter case.
+ */
+static bool getUpdateRect(private_module_t* m, blit_rect* rect)
+{
+    rect->l = 0;
+    rect->t = 0;
+    rect->r = m->info.xres;
+    rect->b = m->info.yres;
+    if (m->info.reserved[0] == UPDATE_RECT_MAGIC) {
+        int l = m->info.reserved[1] & 0xffff;
+        int t = m->info.reserved[1] >> 16;
+        int r = m->info.reserved[2] & 0xffff;
+        int b = m->info.reserved[2] >> 16;
+        if (l > rect->l) rect->l = l;
+        if (t > rect->t) rect->t = t;
+        if (r < rect->r) rect->r = r;
+        if (b < rect->b) rect->b = b;
+        m->info.reserved[0] = 0;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Get the area of the screen that differs from the buffer about to be
+ * posted, from the regions of the buffer locked for writing since it was
+ * last posted, and the areas updated by the posts of other buffers since.
+ * Falls back to the whole screen if either isn't known.
+ */
+static void getBufferDamage(fb_context_t* ctx, private_handle_t const* hnd,
+        blit_rect* rect)
+{
+    blit_rect dirty;
+    if (!takeDirtyRect(hnd, &dirty))
+        return;
+    for (int i = 0; i < ctx->damageCount; i++) {
+        if (ctx->damage[i].buffer == hnd->base) {
+            *rect = dirty;
+            return;
+        }
+        unionRect(&dirty, ctx->damage[i].rect);
+    }
+}
+
+static void addPostedRect(fb_context_t* ctx, private_handle_t const* hnd,
+        const blit_rect& rect)
+{
+    memmove(&ctx->damage[1], &ctx->damage[0],
+            (DAMAGE_HISTORY - 1) * sizeof(ctx->damage[0]));
+    ctx->damage[0].buffer = hnd->base;
+    ctx->damage[0].rect = rect;
+    if (ctx->damageCount < DAMAGE_HISTORY)
+        ctx->damageCount++;
+}
+
+/*
+ * Start the timing of a post: the interval since the previous one, and the
+ * vsyncs missed in that interval given the swap interval.
+ */
+static void startFrameTiming(fb_context_t* ctx, frame_timing* timing)
+{
+    int64_t now = now_ns();
+    memset(timing, 0, sizeof(*timing));
+    if (ctx->lastPost) {
+        timing->interval = now - ctx->lastPost;
+        int64_t vsyncs = (timing->interval + ctx->vsyncPeriod / 2) /
+                ctx->vsyncPeriod;
+        int expected = ctx->swapInterval > 1 ? ctx->swapInterval : 1;
+        if (vsyncs > expected)
+            timing->missedVsyncs = vsyncs - expected;
+    }
+    ctx->lastPost = now;
+}
+
 static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
 {
     if (private_handle_t::validate(buffer) < 0)
@@ -92,42 +455,99 @@ static int fb_post(struct framebuffer_device_t* dev, buffer_handle_t buffer)
     private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(buffer);
     private_module_t* m = reinterpret_cast<private_module_t*>(
             dev->common.module);
+    int err = 0;
+    frame_timing timing;
+    startFrameTiming(ctx, &timing);
 
     if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) {
-        const size_t offset = hnd->base - m->framebuffer->base;
-        m->info.activate = FB_ACTIVATE_VBL;
-        m->info.yoffset = offset / m->finfo.line_length;
-        if (ioctl(m->framebuffer->fd, FBIOPUT_VSCREENINFO, &m->info) == -1) {
-            ALOGE("FBIOPUT_VSCREENINFO failed");
-            m->base.unlock(&m->base, buffer); 
-            return -errno;
+        if (ctx->flipQueueEnabled)
+            return queueFlip(ctx, buffer, timing);
+
+        // the flip itself waits for the next vsync
+        for (int i = 1; i < ctx->swapInterval; i++)
+            waitForVsync(ctx, m);
+        int64_t start = now_ns();
+        err = flipTo(m, buffer,
+                ctx->swapInterval ? FB_ACTIVATE_VBL : FB_ACTIVATE_NOW);
+        timing.flip = now_ns() - start;
+        frameStatsRecord(&ctx->stats, timing);
+        if (err < 0) {
+            m->base.unlock(&m->base, buffer);
+            return err;
         }
-        m->currentBuffer = buffer;
-        
+
     } else {
-        // If we can't do the page_flip, just copy the buffer to the front 
-        // FIXME: use copybit HAL instead of memcpy
-        
+        // If we can't do the page_flip, copy the damaged part of the buffer
+        // to the front, converting it to the format of the panel if needed
+        // FIXME: use copybit HAL instead of the CPU
+
         void* fb_vaddr;
         void* buffer_vaddr;
-        
-        m->base.lock(&m->base, m->framebuffer, 
-                GRALLOC_USAGE_SW_WRITE_RARELY, 
-                0, 0, m->info.xres, m->info.yres,
+        blit_rect rect;
+        if (!getUpdateRect(m, &rect)) {
+            getBufferDamage(ctx, hnd, &rect);
+        }
+        addPostedRect(ctx, hnd, rect);
+
+        m->base.lock(&m->base, m->framebuffer,
+                GRALLOC_USAGE_SW_WRITE_RARELY,
+                rect.l, rect.t, rect.r - rect.l, rect.b - rect.t,
                 &fb_vaddr);
 
-        m->base.lock(&m->base, buffer, 
-                GRALLOC_USAGE_SW_READ_RARELY, 
-                0, 0, m->info.xres, m->info.yres,
+        m->base.lock(&m->base, buffer,
+                GRALLOC_USAGE_SW_READ_RARELY,
+                rect.l, rect.t, rect.r - rect.l, rect.b - rect.t,
                 &buffer_vaddr);
 
-        memcpy(fb_vaddr, buffer_vaddr, m->finfo.line_length * m->info.yres);
-        
-        m->base.unlock(&m->base, buffer); 
-        m->base.unlock(&m->base, m->framebuffer); 
+        // buffers allocated before the handle recorded the format and
+        // stride have the layout of the framebuffer
+        int fbFormat = getFramebufferFormat(m);
+        int format = hnd->format ? hnd->format : fbFormat;
+        size_t stride = m->finfo.line_length;
+        if (hnd->stride)
+            stride = hnd->stride * bytesPerPixel(format);
+        if (hnd->width && rect.r > hnd->width)
+            rect.r = hnd->width;
+        if (hnd->height && rect.b > hnd->height)
+            rect.b = hnd->height;
+
+        int64_t start = now_ns();
+        err = blitRect(fb_vaddr, fbFormat, m->finfo.line_length,
+                buffer_vaddr, format, stride, rect);
+        timing.blit = now_ns() - start;
+        frameStatsRecord(&ctx->stats, timing);
+        if (err < 0)
+            ALOGE("cannot post a buffer of format %d", format);
+
+        m->base.unlock(&m->base, buffer);
+        m->base.unlock(&m->base, m->framebuffer);
     }
-    
-    return 0;
+
+    return err;
+}
+
+static void fb_dump(struct framebuffer_device_t* dev, char* buff, int buff_len)
+{
+    fb_context_t* ctx = (fb_context_t*)dev;
+    private_module_t* m = reinterpret_cast<private_module_t*>(
+            dev->common.module);
+
+    int pos = snprintf(buff, buff_len,
+            "fbdev gralloc: %ux%u, %.2f Hz, %u buffers, %s, "
+            "swap interval %d\n", dev->width, dev->height, dev->fps,
+            m->numBuffers, (m->flags & PAGE_FLIP) ? "page flipping" : "blit",
+            ctx->swapInterval);
+    if (ctx->flipQueueEnabled && pos >= 0 && pos < buff_len) {
+        flip_queue& q = ctx->queue;
+        pthread_mutex_lock(&q.lock);
+        snprintf(buff + pos, buff_len - pos,
+                "  flip queue: %s buffering, %llu flips, %llu late, "
+                "%llu dropped\n", ctx->buffering == 3 ? "triple" : "double",
+                (unsigned long long)q.flips, (unsigned long long)q.late,
+                (unsigned long long)q.dropped);
+        pthread_mutex_unlock(&q.lock);
+    }
+    frameStatsDump(&ctx->stats, ctx->vsyncPeriod, buff, buff_len);
 }
 
 /*****************************************************************************/
@@ -172,13 +592,25 @@ int mapFrameBufferLocked(struct private_module_t* module)
     info.activate = FB_ACTIVATE_NOW;
 
     /*
-     * Request NUM_BUFFERS screens (at lest 2 for page flipping)
+     * Request as many screens as the driver can give, up to
+     * PROP_MAX_BUFFERS (at least 2 for page flipping)
      */
-    info.yres_virtual = info.yres * NUM_BUFFERS;
-
+    uint32_t maxBuffers = getLongProperty(PROP_MAX_BUFFERS,
+            DEFAULT_MAX_BUFFERS);
+    if (maxBuffers > MAX_FRAMEBUFFERS)
+        maxBuffers = MAX_FRAMEBUFFERS;
+    // with double buffering asked for, a third buffer would only cost memory
+    if (getLongProperty(PROP_BUFFERING, 0) == 2 && maxBuffers > 2)
+        maxBuffers = 2;
 
     uint32_t flags = PAGE_FLIP;
-    if (ioctl(fd, FBIOPUT_VSCREENINFO, &info) == -1) {
+    uint32_t n;
+    for (n = maxBuffers; n >= 2; n--) {
+        info.yres_virtual = info.yres * n;
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &info) == 0)
+            break;
+    }
+    if (n < 2) {
         info.yres_virtual = info.yres;
         flags &= ~PAGE_FLIP;
         ALOGW("FBIOPUT_VSCREENINFO failed, page flipping not supported");
@@ -273,18 +705,30 @@ int mapFrameBufferLocked(struct private_module_t* module)
 
     int err;
     size_t fbSize = roundUpToPageSize(finfo.line_length * info.yres_virtual);
-    module->framebuffer = new private_handle_t(dup(fd), fbSize, 0);
 
-    module->numBuffers = info.yres_virtual / info.yres;
-    module->bufferMask = 0;
+    // the driver may give more than requested
+    uint32_t numBuffers = info.yres_virtual / info.yres;
+    if (!(flags & PAGE_FLIP))
+        numBuffers = 1;
+    if (numBuffers > maxBuffers)
+        numBuffers = maxBuffers;
+    module->numBuffers = numBuffers;
+    initFramebufferSlots(module, numBuffers);
+    ALOGI("using %u framebuffer buffers", numBuffers);
 
     void* vaddr = mmap(0, fbSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
     if (vaddr == MAP_FAILED) {
         ALOGE("Error mapping the framebuffer (%s)", strerror(errno));
         return -errno;
     }
-    module->framebuffer->base = intptr_t(vaddr);
     memset(vaddr, 0, fbSize);
+
+    private_handle_t* framebuffer = new private_handle_t(dup(fd), fbSize, 0);
+    framebuffer->base = intptr_t(vaddr);
+    // gralloc_alloc_framebuffer() checks it without the lock, publish it
+    // once everything else is set up
+    android_memory_barrier();
+    module->framebuffer = framebuffer;
     return 0;
 }
 
@@ -302,6 +746,8 @@ static int fb_close(struct hw_device_t *dev)
 {
     fb_context_t* ctx = (fb_context_t*)dev;
     if (ctx) {
+        if (ctx->flipQueueEnabled)
+            stopFlipQueue(ctx);
         free(ctx);
     }
     return 0;
@@ -324,14 +770,17 @@ int fb_device_open(hw_module_t const* module, const char* name,
         dev->device.setSwapInterval = fb_setSwapInterval;
         dev->device.post            = fb_post;
         dev->device.setUpdateRect = 0;
+        dev->device.dump            = fb_dump;
 
         private_module_t* m = (private_module_t*)module;
         status = mapFrameBuffer(m);
         if (status >= 0) {
             int stride = m->finfo.line_length / (m->info.bits_per_pixel >> 3);
-            int format = (m->info.bits_per_pixel == 32)
-                         ? HAL_PIXEL_FORMAT_RGBX_8888
-                         : HAL_PIXEL_FORMAT_RGB_565;
+            int format = getFramebufferFormat(m);
+            if (!(m->flags & PAGE_FLIP)) {
+                // fb_post() copies only the rectangle that was updated
+                dev->device.setUpdateRect = fb_setUpdateRect;
+            }
             const_cast<uint32_t&>(dev->device.flags) = 0;
             const_cast<uint32_t&>(dev->device.width) = m->info.xres;
             const_cast<uint32_t&>(dev->device.height) = m->info.yres;
@@ -340,8 +789,33 @@ int fb_device_open(hw_module_t const* module, const char* name,
             const_cast<float&>(dev->device.xdpi) = m->xdpi;
             const_cast<float&>(dev->device.ydpi) = m->ydpi;
             const_cast<float&>(dev->device.fps) = m->fps;
-            const_cast<int&>(dev->device.minSwapInterval) = 1;
-            const_cast<int&>(dev->device.maxSwapInterval) = 1;
+            const_cast<int&>(dev->device.minSwapInterval) = 0;
+            const_cast<int&>(dev->device.maxSwapInterval) = 2;
+            dev->swapInterval = 1;
+            dev->waitForVsyncSupported = true;
+            dev->vsyncPeriod = int64_t(1000000000.0f / m->fps);
+
+            dev->buffering = getLongProperty(PROP_BUFFERING, 0);
+            dev->autoBuffering = dev->buffering != 2 && dev->buffering != 3;
+            if (dev->autoBuffering)
+                dev->buffering = 3;
+
+            if ((m->flags & PAGE_FLIP) &&
+                    getLongProperty(PROP_FLIP_QUEUE, 0)) {
+                if (m->numBuffers >= 3 || dev->buffering == 2)
+                    startFlipQueue(dev);
+                else
+                    ALOGW("the flip queue needs 3 buffers, flipping synchronously");
+            }
+            if ((m->flags & PAGE_FLIP) && !dev->flipQueueEnabled) {
+                ALOGW_IF(!dev->autoBuffering && dev->buffering == 3,
+                        "triple buffering needs %s, fb_post() will wait "
+                        "for every flip", PROP_FLIP_QUEUE);
+                dev->buffering = 2;
+                dev->autoBuffering = false;
+            }
+
+            const_cast<int&>(dev->device.numFramebuffers) = m->numBuffers;
             *device = &dev->device.common;
         }
     }
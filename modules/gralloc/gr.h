@@ -25,6 +25,7 @@
 #endif
 #include <limits.h>
 #include <sys/cdefs.h>
+#include <sys/types.h>
 #include <hardware/gralloc.h>
 #include <pthread.h>
 #include <errno.h>
@@ -41,9 +42,197 @@ inline size_t roundUpToPageSize(size_t x) {
 }
 
 int mapFrameBufferLocked(struct private_module_t* module);
+void initFramebufferSlots(private_module_t* m, uint32_t numBuffers);
 int terminateBuffer(gralloc_module_t const* module, private_handle_t* hnd);
 int mapBuffer(gralloc_module_t const* module, private_handle_t* hnd);
 
+// Size of the memory allocated for a buffer of 'size' bytes, which large
+// buffers round up to a whole number of huge pages.
+size_t getBackingSize(size_t size);
+size_t getHugePageSize();
+// Allocate the memory of a buffer of getBackingSize() bytes, returns its
+// file descriptor, sets 'type' to its BACKING_* and 'flags' to the
+// PRIV_FLAGS_* its mapping needs, or returns -errno.
+int allocateBacking(size_t size, int* type, int* flags);
+
+// Identity of the memory behind a buffer, the same in every process.
+struct buffer_key {
+    enum {
+        // the device and inode identify the buffer (memfd)
+        UNIQUE,
+        // the key is a hint, to be confirmed with isSameBufferFile()
+        // (ashmem and dma-buf, which may share their inode)
+        CHECK_FILE,
+        // the buffer can't be told apart from others
+        NONE
+    };
+    dev_t dev;
+    ino_t ino;
+    // allocating process and id of the buffer, for CHECK_FILE keys
+    pid_t pid;
+    int id;
+    int match;
+};
+
+int getBufferKey(private_handle_t const* hnd, buffer_key* key);
+// Whether 'fd1' and 'fd2' refer to the same open file, as the kernel sees
+// it, for CHECK_FILE keys.
+bool isSameBufferFile(int fd1, int fd2);
+// Id of a new buffer, unique in this process.
+int nextBufferId();
+// Bracket CPU accesses to the buffer, for backings that need it.
+void syncBacking(private_handle_t const* hnd, bool start);
+
+// Get the non-negative integer value of property 'key', or 'defaultValue'.
+long getLongProperty(const char* key, long defaultValue);
+// CLOCK_MONOTONIC time in nanoseconds.
+int64_t now_ns();
+// Append printf-style text at 'pos' in 'buff', the dump() buffer of
+// 'buff_len' bytes, and advance 'pos'. Text past the end is dropped.
+void appendf(char* buff, int buff_len, int* pos, const char* fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+
+/*****************************************************************************/
+
+// Layout of the planes of a YUV 4:2:0 buffer, offsets are in bytes from the
+// start of the buffer.
+struct ycbcr_layout {
+    size_t yStride;
+    size_t cStride;
+    size_t chromaStep;
+    size_t crOffset;
+    size_t cbOffset;
+    size_t size;
+};
+
+// Get the layout of a 'format' buffer allocated for 'usage', of 'height'
+// rows of 'stride' pixels. Returns -EINVAL if 'format' isn't a YUV 4:2:0
+// format.
+int getYCbCrLayout(int format, int usage, int height, int stride,
+        ycbcr_layout* layout);
+
+/*****************************************************************************/
+
+// Rectangle in pixels, right and bottom are exclusive.
+struct blit_rect {
+    int l;
+    int t;
+    int r;
+    int b;
+};
+
+inline bool isEmptyRect(const blit_rect& rect) {
+    return rect.r <= rect.l || rect.b <= rect.t;
+}
+
+inline void unionRect(blit_rect* rect, const blit_rect& other) {
+    if (isEmptyRect(other))
+        return;
+    if (isEmptyRect(*rect)) {
+        *rect = other;
+        return;
+    }
+    if (other.l < rect->l) rect->l = other.l;
+    if (other.t < rect->t) rect->t = other.t;
+    if (other.r > rect->r) rect->r = other.r;
+    if (other.b > rect->b) rect->b = other.b;
+}
+
+// Whether the regions written to buffers allocated for 'usage' can be
+// tracked: nothing but the CPU may write to them.
+inline bool canTrackDirtyRect(int usage) {
+    return (usage & GRALLOC_USAGE_SW_WRITE_MASK) &&
+            !(usage & ~(GRALLOC_USAGE_SW_READ_MASK |
+                        GRALLOC_USAGE_SW_WRITE_MASK |
+                        GRALLOC_USAGE_HW_TEXTURE |
+                        GRALLOC_USAGE_HW_COMPOSER));
+}
+
+// Get the union of the regions of 'hnd' locked for writing since the last
+// call, and reset it. Returns false if it isn't known: the buffer wasn't
+// allocated by this process for the CPU only, or another process locked it
+// for writing since the last call.
+bool takeDirtyRect(private_handle_t const* hnd, blit_rect* rect);
+
+// Get the size of the pixels of an RGB 'format', or 0.
+size_t bytesPerPixel(int format);
+
+// Copy 'rect' from 'src' to 'dst', converting the pixels if the formats
+// differ. Strides are in bytes. Returns -EINVAL if a format isn't an RGB
+// format or if there is no conversion between them.
+int blitRect(void* dst, int dstFormat, size_t dstStride,
+        const void* src, int srcFormat, size_t srcStride,
+        const blit_rect& rect);
+
+/*****************************************************************************/
+
+// Timing of a post in nanoseconds, 0 when not applicable.
+struct frame_timing {
+    int64_t interval;       // since the previous post
+    int64_t flip;           // FBIOPUT_VSCREENINFO
+    int64_t blit;           // copy to the front buffer
+    int32_t missedVsyncs;
+};
+
+#define FRAME_STATS_SIZE 256    // must be a power of 2
+
+struct frame_record {
+    volatile int32_t seq;
+    frame_timing timing;
+};
+
+// Ring of the timings of the last FRAME_STATS_SIZE posts.
+struct frame_stats {
+    volatile int32_t next;
+    frame_record records[FRAME_STATS_SIZE];
+};
+
+// Record the timing of a post, never blocks.
+void frameStatsRecord(frame_stats* stats, const frame_timing& timing);
+// Append the percentiles of the recorded timings to the string in 'buff'.
+void frameStatsDump(frame_stats* stats, int64_t vsyncPeriod,
+        char* buff, int buff_len);
+
+/*****************************************************************************/
+
+struct gralloc_pool_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t retainedBytes;
+    size_t retainedBuffers;
+};
+
+// Take a mapped buffer of 'size' bytes freed with 'usage' out of the pool,
+// and zero it. Returns NULL if there is none.
+private_handle_t* gralloc_pool_take(size_t size, int usage);
+// Keep the mapped buffer 'hnd' in the pool rather than destroying it.
+// Returns false if the pool doesn't want it.
+bool gralloc_pool_give(gralloc_module_t const* module, private_handle_t* hnd,
+        int usage);
+// Destroy all the buffers in the pool.
+void gralloc_pool_trim();
+void gralloc_pool_get_stats(gralloc_pool_stats* stats);
+
+/*****************************************************************************/
+
+struct memtrack_record;
+
+// Record that 'dev' handed out the buffer 'hnd'.
+void trackAllocation(alloc_device_t const* dev, private_handle_t* hnd);
+// Forget the buffer 'hnd', returns false if it wasn't recorded.
+bool untrackAllocation(private_handle_t const* hnd);
+// Forget and return the oldest buffer still allocated by 'dev', or NULL.
+private_handle_t* untrackAllocationOf(alloc_device_t const* dev);
+// Append the allocated buffers and the pool statistics to 'buff'.
+void dumpAllocations(char* buff, int buff_len);
+// memtrack getMemory() for the buffers allocated in this process, whatever
+// 'pid' is: which processes use them isn't known.
+int getAllocationMemory(pid_t pid, int type,
+        struct memtrack_record* records, size_t* num_records);
+// Number of handles of the buffer registered in this process.
+int getMappingCount(private_handle_t const* hnd);
+
 /*****************************************************************************/
 
 class Locker {
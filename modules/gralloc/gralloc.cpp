@@ -19,8 +19,11 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -30,6 +33,7 @@
 #include <cutils/ashmem.h>
 #include <cutils/log.h>
 #include <cutils/atomic.h>
+#include <cutils/properties.h>
 
 #include <hardware/hardware.h>
 #include <hardware/gralloc.h>
@@ -44,6 +48,30 @@ struct gralloc_context_t {
     /* our private data here */
 };
 
+/*
+ * Alignment of the rows and planes of the buffers. Rows are aligned to
+ * PROP_ROW_ALIGN bytes (at least 4, 16 pixels for YUV formats), and to
+ * PROP_ROW_ALIGN_SW_OFTEN bytes, a cache line by default, when the CPU
+ * accesses the buffer often, so that every row starts on a cache line and
+ * can be loaded with aligned SIMD loads. The chroma planes of flexible YUV
+ * buffers used by hardware start on a PROP_PLANE_ALIGN_HW boundary.
+ *
+ * The RGB and RAW rows of buffers the camera writes are not padded: camera
+ * HALs get no stride from lock() and assume it is the width.
+ */
+#define PROP_ROW_ALIGN          "ro.gralloc.row_align"
+#define PROP_ROW_ALIGN_SW_OFTEN "ro.gralloc.row_align.sw_often"
+#define PROP_PLANE_ALIGN_HW     "ro.gralloc.plane_align.hw"
+
+struct alignment_policy {
+    size_t rowAlign;
+    size_t rowAlignSwOften;
+    size_t planeAlignHw;
+};
+
+static alignment_policy sAlignment;
+static pthread_once_t sAlignmentOnce = PTHREAD_ONCE_INIT;
+
 static int gralloc_alloc_buffer(alloc_device_t* dev,
         size_t size, int usage, buffer_handle_t* pHandle);
 
@@ -63,12 +91,20 @@ extern int gralloc_lock(gralloc_module_t const* module,
 extern int gralloc_unlock(gralloc_module_t const* module, 
         buffer_handle_t handle);
 
+extern int gralloc_lock_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr *ycbcr);
+
 extern int gralloc_register_buffer(gralloc_module_t const* module,
         buffer_handle_t handle);
 
 extern int gralloc_unregister_buffer(gralloc_module_t const* module,
         buffer_handle_t handle);
 
+static int gralloc_perform(gralloc_module_t const* module,
+        int operation, ... );
+
 /*****************************************************************************/
 
 static struct hw_module_methods_t gralloc_module_methods = {
@@ -79,8 +115,8 @@ struct private_module_t HAL_MODULE_INFO_SYM = {
     base: {
         common: {
             tag: HARDWARE_MODULE_TAG,
-            version_major: 1,
-            version_minor: 0,
+            module_api_version: GRALLOC_MODULE_API_VERSION_0_2,
+            hal_api_version: 0,
             id: GRALLOC_HARDWARE_MODULE_ID,
             name: "Graphics Memory Allocator Module",
             author: "The Android Open Source Project",
@@ -90,34 +126,89 @@ struct private_module_t HAL_MODULE_INFO_SYM = {
         unregisterBuffer: gralloc_unregister_buffer,
         lock: gralloc_lock,
         unlock: gralloc_unlock,
+        perform: gralloc_perform,
+        lock_ycbcr: gralloc_lock_ycbcr,
     },
     framebuffer: 0,
     flags: 0,
     numBuffers: 0,
-    bufferMask: 0,
+    freeBuffers: 0,
+    nextFreeBuffer: {},
     lock: PTHREAD_MUTEX_INITIALIZER,
     currentBuffer: 0,
 };
 
 /*****************************************************************************/
 
-static int gralloc_alloc_framebuffer_locked(alloc_device_t* dev,
+/*
+ * The free framebuffer slots form a stack linked through nextFreeBuffer[],
+ * updated with compare-and-swap so that slots are allocated and freed from
+ * any thread without a lock. freeBuffers holds the index of the top slot in
+ * its low 8 bits, NO_FREE_BUFFER if there is none, and a generation count
+ * in the others, bumped on every update so that a slot popped and pushed
+ * back between the load and the CAS of another thread can't fool it. The
+ * count wraps around, so it is computed unsigned.
+ */
+#define NO_FREE_BUFFER      0xffu
+#define FREE_INDEX_MASK     0xffu
+#define FREE_GENERATION     0x100u
+
+void initFramebufferSlots(private_module_t* m, uint32_t numBuffers)
+{
+    // slot 0 is handed out first
+    for (uint32_t i = 0; i < numBuffers; i++)
+        m->nextFreeBuffer[i] = (i + 1 < numBuffers) ? i + 1 : NO_FREE_BUFFER;
+    android_atomic_release_store(numBuffers ? 0 : NO_FREE_BUFFER,
+            &m->freeBuffers);
+}
+
+static int takeFramebufferSlot(private_module_t* m)
+{
+    uint32_t head, next;
+    uint32_t index;
+    do {
+        head = android_atomic_acquire_load(&m->freeBuffers);
+        index = head & FREE_INDEX_MASK;
+        if (index == NO_FREE_BUFFER)
+            return -1;
+        next = ((head & ~FREE_INDEX_MASK) + FREE_GENERATION) |
+                m->nextFreeBuffer[index];
+    } while (android_atomic_acquire_cas(int32_t(head), int32_t(next),
+            &m->freeBuffers));
+    return index;
+}
+
+static void releaseFramebufferSlot(private_module_t* m, uint32_t index)
+{
+    uint32_t head, next;
+    do {
+        head = android_atomic_acquire_load(&m->freeBuffers);
+        m->nextFreeBuffer[index] = head & FREE_INDEX_MASK;
+        next = ((head & ~FREE_INDEX_MASK) + FREE_GENERATION) | index;
+    } while (android_atomic_release_cas(int32_t(head), int32_t(next),
+            &m->freeBuffers));
+}
+
+static int gralloc_alloc_framebuffer(alloc_device_t* dev,
         size_t size, int usage, buffer_handle_t* pHandle)
 {
     private_module_t* m = reinterpret_cast<private_module_t*>(
             dev->common.module);
 
     // allocate the framebuffer
-    if (m->framebuffer == NULL) {
+    private_handle_t* framebuffer = m->framebuffer;
+    android_memory_barrier();
+    if (framebuffer == NULL) {
         // initialize the framebuffer, the framebuffer is mapped once
         // and forever.
+        pthread_mutex_lock(&m->lock);
         int err = mapFrameBufferLocked(m);
+        pthread_mutex_unlock(&m->lock);
         if (err < 0) {
             return err;
         }
     }
 
-    const uint32_t bufferMask = m->bufferMask;
     const uint32_t numBuffers = m->numBuffers;
     const size_t bufferSize = m->finfo.line_length * m->info.yres;
     if (numBuffers == 1) {
@@ -128,25 +219,18 @@ static int gralloc_alloc_framebuffer_locked(alloc_device_t* dev,
         return gralloc_alloc_buffer(dev, bufferSize, newUsage, pHandle);
     }
 
-    if (bufferMask >= ((1LU<<numBuffers)-1)) {
+    // take a free slot
+    int index = takeFramebufferSlot(m);
+    if (index < 0) {
         // We ran out of buffers.
         return -ENOMEM;
     }
 
     // create a "fake" handles for it
-    intptr_t vaddr = intptr_t(m->framebuffer->base);
     private_handle_t* hnd = new private_handle_t(dup(m->framebuffer->fd), size,
             private_handle_t::PRIV_FLAGS_FRAMEBUFFER);
+    intptr_t vaddr = intptr_t(m->framebuffer->base) + index * bufferSize;
 
-    // find a free slot
-    for (uint32_t i=0 ; i<numBuffers ; i++) {
-        if ((bufferMask & (1LU<<i)) == 0) {
-            m->bufferMask |= (1LU<<i);
-            break;
-        }
-        vaddr += bufferSize;
-    }
-    
     hnd->base = vaddr;
     hnd->offset = vaddr - intptr_t(m->framebuffer->base);
     *pHandle = hnd;
@@ -154,39 +238,47 @@ static int gralloc_alloc_framebuffer_locked(alloc_device_t* dev,
     return 0;
 }
 
-static int gralloc_alloc_framebuffer(alloc_device_t* dev,
-        size_t size, int usage, buffer_handle_t* pHandle)
-{
-    private_module_t* m = reinterpret_cast<private_module_t*>(
-            dev->common.module);
-    pthread_mutex_lock(&m->lock);
-    int err = gralloc_alloc_framebuffer_locked(dev, size, usage, pHandle);
-    pthread_mutex_unlock(&m->lock);
-    return err;
-}
-
 static int gralloc_alloc_buffer(alloc_device_t* dev,
         size_t size, int usage, buffer_handle_t* pHandle)
 {
     int err = 0;
     int fd = -1;
 
-    size = roundUpToPageSize(size);
-    
-    fd = ashmem_create_region("gralloc-buffer", size);
-    if (fd < 0) {
-        ALOGE("couldn't create ashmem (%s)", strerror(-errno));
-        err = -errno;
+    size = getBackingSize(roundUpToPageSize(size));
+
+    private_handle_t* hnd = gralloc_pool_take(size, usage);
+    if (hnd) {
+        *pHandle = hnd;
+        return 0;
     }
 
-    if (err == 0) {
-        private_handle_t* hnd = new private_handle_t(fd, size, 0);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (attempt > 0) {
+            // we may be short of memory, release what the pool holds
+            // and try once more
+            gralloc_pool_trim();
+        }
+
+        int backing, flags;
+        fd = allocateBacking(size, &backing, &flags);
+        if (fd < 0) {
+            err = fd;
+            continue;
+        }
+
+        hnd = new private_handle_t(fd, size, flags);
+        hnd->backing = backing;
+        hnd->id = nextBufferId();
+        hnd->usage = usage;
         gralloc_module_t* module = reinterpret_cast<gralloc_module_t*>(
                 dev->common.module);
         err = mapBuffer(module, hnd);
         if (err == 0) {
             *pHandle = hnd;
+            break;
         }
+        close(fd);
+        delete hnd;
     }
     
     ALOGE_IF(err, "gralloc failed err=%s", strerror(-err));
@@ -196,6 +288,147 @@ static int gralloc_alloc_buffer(alloc_device_t* dev,
 
 /*****************************************************************************/
 
+long getLongProperty(const char* key, long defaultValue)
+{
+    char value[PROPERTY_VALUE_MAX];
+    if (property_get(key, value, NULL) > 0) {
+        char* end;
+        long v = strtol(value, &end, 0);
+        if (*end == '\0' && v >= 0)
+            return v;
+        ALOGW("ignoring invalid %s=%s", key, value);
+    }
+    return defaultValue;
+}
+
+int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+void appendf(char* buff, int buff_len, int* pos, const char* fmt, ...)
+{
+    if (*pos >= buff_len)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buff + *pos, buff_len - *pos, fmt, args);
+    va_end(args);
+    if (n > 0)
+        *pos += n;
+}
+
+static inline size_t alignTo(size_t x, size_t align) {
+    return (x + (align-1)) & ~(align-1);
+}
+
+static size_t gcd(size_t a, size_t b) {
+    while (b) {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static size_t getAlignmentProperty(const char* key, size_t defaultValue)
+{
+    size_t align = getLongProperty(key, defaultValue);
+    if (align == 0 || (align & (align - 1))) {
+        ALOGW("%s=%zu is not a power of 2, using %zu", key, align,
+                defaultValue);
+        return defaultValue;
+    }
+    return align;
+}
+
+static void initAlignmentPolicy()
+{
+    sAlignment.rowAlign = getAlignmentProperty(PROP_ROW_ALIGN, 4);
+    sAlignment.rowAlignSwOften = getAlignmentProperty(
+            PROP_ROW_ALIGN_SW_OFTEN, 64);
+    sAlignment.planeAlignHw = getAlignmentProperty(
+            PROP_PLANE_ALIGN_HW, PAGE_SIZE);
+}
+
+static const alignment_policy& getAlignmentPolicy()
+{
+    pthread_once(&sAlignmentOnce, initAlignmentPolicy);
+    return sAlignment;
+}
+
+// Get the alignment in bytes of the rows of a 'format' buffer for 'usage'.
+static size_t getRowAlignment(int format, int usage)
+{
+    const alignment_policy& policy = getAlignmentPolicy();
+    size_t align = policy.rowAlign > 4 ? policy.rowAlign : 4;
+
+    if (usage & GRALLOC_USAGE_HW_FB) {
+        // must match the layout of the framebuffer
+        return 4;
+    }
+    if (usage & GRALLOC_USAGE_HW_CAMERA_WRITE) {
+        // stride == width
+        align = 1;
+    } else if ((usage & GRALLOC_USAGE_SW_READ_MASK) ==
+                    GRALLOC_USAGE_SW_READ_OFTEN ||
+            (usage & GRALLOC_USAGE_SW_WRITE_MASK) ==
+                    GRALLOC_USAGE_SW_WRITE_OFTEN) {
+        if (policy.rowAlignSwOften > align)
+            align = policy.rowAlignSwOften;
+    }
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YV12:
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+        case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            // YV12 requires 16-pixel aligned rows
+            if (align < 16)
+                align = 16;
+            break;
+    }
+    return align;
+}
+
+int getYCbCrLayout(int format, int usage, int height, int stride,
+        ycbcr_layout* layout)
+{
+    size_t ySize = size_t(stride) * height;
+    size_t cHeight = (height + 1) / 2;
+
+    switch (format) {
+        case HAL_PIXEL_FORMAT_YV12:
+            // Y plane, then Cr and Cb planes with 16-pixel aligned strides
+            layout->yStride = stride;
+            layout->cStride = alignTo(stride / 2, 16);
+            layout->chromaStep = 1;
+            layout->crOffset = ySize;
+            layout->cbOffset = ySize + layout->cStride * cHeight;
+            layout->size = ySize + 2 * layout->cStride * cHeight;
+            return 0;
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+        case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            // NV21: Y plane, then interleaved Cr/Cb samples
+            layout->yStride = stride;
+            layout->cStride = stride;
+            layout->chromaStep = 2;
+            layout->crOffset = ySize;
+            if (format == HAL_PIXEL_FORMAT_YCbCr_420_888 &&
+                    (usage & GRALLOC_USAGE_HW_MASK)) {
+                // the flexible layout lets the chroma plane start anywhere
+                layout->crOffset = alignTo(ySize,
+                        getAlignmentPolicy().planeAlignHw);
+            }
+            layout->cbOffset = layout->crOffset + 1;
+            layout->size = layout->crOffset + size_t(stride) * cHeight;
+            return 0;
+    }
+    return -EINVAL;
+}
+
+/*****************************************************************************/
+
 static int gralloc_alloc(alloc_device_t* dev,
         int w, int h, int format, int usage,
         buffer_handle_t* pHandle, int* pStride)
@@ -205,7 +438,17 @@ static int gralloc_alloc(alloc_device_t* dev,
 
     size_t size, stride;
 
-    int align = 4;
+    if (format == HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED) {
+        // buffers exchanged with the camera or the video encoder are YUV,
+        // everything else is RGB
+        if (usage & (GRALLOC_USAGE_HW_CAMERA_MASK |
+                     GRALLOC_USAGE_HW_VIDEO_ENCODER)) {
+            format = HAL_PIXEL_FORMAT_YCrCb_420_SP;
+        } else {
+            format = HAL_PIXEL_FORMAT_RGBX_8888;
+        }
+    }
+
     int bpp = 0;
     switch (format) {
         case HAL_PIXEL_FORMAT_RGBA_8888:
@@ -220,12 +463,34 @@ static int gralloc_alloc(alloc_device_t* dev,
         case HAL_PIXEL_FORMAT_RAW_SENSOR:
             bpp = 2;
             break;
+        case HAL_PIXEL_FORMAT_YV12:
+        case HAL_PIXEL_FORMAT_YCrCb_420_SP:
+        case HAL_PIXEL_FORMAT_YCbCr_420_888:
+            bpp = 1;
+            break;
         default:
             return -EINVAL;
     }
-    size_t bpr = (w*bpp + (align-1)) & ~(align-1);
+
+    // align the stride in pixels so that rows are a whole number of pixels
+    // and of alignment units, including for 3-byte pixels
+    size_t align = getRowAlignment(format, usage);
+    size_t pixelAlign = align / gcd(align, bpp);
+    stride = (w + pixelAlign - 1) / pixelAlign * pixelAlign;
+    size_t bpr = stride * bpp;
     size = bpr * h;
-    stride = bpr / bpp;
+
+    ycbcr_layout layout;
+    if (getYCbCrLayout(format, usage, h, stride, &layout) == 0) {
+        size = layout.size;
+    }
+
+    // room for the count of the locks from other processes
+    bool dirtyTracked = !(usage & GRALLOC_USAGE_HW_FB) &&
+            canTrackDirtyRect(usage);
+    if (dirtyTracked) {
+        size += sizeof(int32_t);
+    }
 
     int err;
     if (usage & GRALLOC_USAGE_HW_FB) {
@@ -238,44 +503,104 @@ static int gralloc_alloc(alloc_device_t* dev,
         return err;
     }
 
+    private_handle_t* hnd = (private_handle_t*)*pHandle;
+    if (dirtyTracked) {
+        hnd->flags |= private_handle_t::PRIV_FLAGS_DIRTY_TRACKED;
+    }
+    hnd->format = format;
+    hnd->width = w;
+    hnd->height = h;
+    hnd->stride = stride;
+    trackAllocation(dev, hnd);
+
     *pStride = stride;
     return 0;
 }
 
-static int gralloc_free(alloc_device_t* dev,
-        buffer_handle_t handle)
+static void gralloc_free_buffer(alloc_device_t* dev,
+        private_handle_t const* hnd)
 {
-    if (private_handle_t::validate(handle) < 0)
-        return -EINVAL;
-
-    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(handle);
     if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) {
         // free this buffer
         private_module_t* m = reinterpret_cast<private_module_t*>(
                 dev->common.module);
         const size_t bufferSize = m->finfo.line_length * m->info.yres;
         int index = (hnd->base - m->framebuffer->base) / bufferSize;
-        m->bufferMask &= ~(1<<index); 
+        releaseFramebufferSlot(m, index);
     } else { 
         gralloc_module_t* module = reinterpret_cast<gralloc_module_t*>(
                 dev->common.module);
-        terminateBuffer(module, const_cast<private_handle_t*>(hnd));
+        private_handle_t* h = const_cast<private_handle_t*>(hnd);
+        if (gralloc_pool_give(module, h, hnd->usage)) {
+            // the pool now owns the buffer
+            return;
+        }
+        terminateBuffer(module, h);
     }
 
     close(hnd->fd);
     delete hnd;
+}
+
+static int gralloc_free(alloc_device_t* dev,
+        buffer_handle_t handle)
+{
+    if (private_handle_t::validate(handle) < 0)
+        return -EINVAL;
+
+    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(handle);
+    if (!untrackAllocation(hnd)) {
+        // not ours, or already freed
+        ALOGE("freeing unknown buffer %p", hnd);
+        return -EINVAL;
+    }
+    gralloc_free_buffer(dev, hnd);
     return 0;
 }
 
+static void gralloc_dump(alloc_device_t* dev, char* buff, int buff_len)
+{
+    if (buff_len <= 0)
+        return;
+    buff[0] = '\0';
+    dumpAllocations(buff, buff_len);
+}
+
+static int gralloc_perform(gralloc_module_t const* module,
+        int operation, ... )
+{
+    int err = -EINVAL;
+    va_list args;
+    va_start(args, operation);
+    switch (operation) {
+        case GRALLOC_PERFORM_GET_MEMORY: {
+            pid_t pid = va_arg(args, pid_t);
+            int type = va_arg(args, int);
+            struct memtrack_record* records =
+                    va_arg(args, struct memtrack_record*);
+            size_t* num_records = va_arg(args, size_t*);
+            err = getAllocationMemory(pid, type, records, num_records);
+            break;
+        }
+    }
+    va_end(args);
+    return err;
+}
+
 /*****************************************************************************/
 
 static int gralloc_close(struct hw_device_t *dev)
 {
     gralloc_context_t* ctx = reinterpret_cast<gralloc_context_t*>(dev);
     if (ctx) {
-        /* TODO: keep a list of all buffer_handle_t created, and free them
-         * all here.
-         */
+        // free the buffers our clients leaked
+        size_t leaked = 0;
+        private_handle_t* hnd;
+        while ((hnd = untrackAllocationOf(&ctx->device)) != NULL) {
+            gralloc_free_buffer(&ctx->device, hnd);
+            leaked++;
+        }
+        ALOGW_IF(leaked, "freed %zu leaked buffers", leaked);
         free(ctx);
     }
     return 0;
@@ -300,6 +625,7 @@ int gralloc_device_open(const hw_module_t* module, const char* name,
 
         dev->device.alloc   = gralloc_alloc;
         dev->device.free    = gralloc_free;
+        dev->device.dump    = gralloc_dump;
 
         *device = &dev->device.common;
         status = 0;
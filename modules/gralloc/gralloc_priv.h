@@ -34,13 +34,17 @@
 struct private_module_t;
 struct private_handle_t;
 
+#define MAX_FRAMEBUFFERS 8
+
 struct private_module_t {
     gralloc_module_t base;
 
     private_handle_t* framebuffer;
     uint32_t flags;
     uint32_t numBuffers;
-    uint32_t bufferMask;
+    // lock-free stack of the free framebuffer slots, see gralloc.cpp
+    volatile int32_t freeBuffers;
+    uint8_t nextFreeBuffer[MAX_FRAMEBUFFERS];
     pthread_mutex_t lock;
     buffer_handle_t currentBuffer;
     int pmem_master;
@@ -55,6 +59,24 @@ struct private_module_t {
 
 /*****************************************************************************/
 
+/*
+ * gralloc_module_t::perform() operations
+ */
+enum {
+    /*
+     * int perform(module, GRALLOC_PERFORM_GET_MEMORY, pid_t pid, int type,
+     *         struct memtrack_record* records, size_t* num_records)
+     *
+     * memtrack getMemory() for the buffers allocated in this process, for a
+     * memtrack HAL that lives in the allocating process. The buffers are
+     * not split by the processes they are handed to, which gralloc doesn't
+     * know: 'pid' is ignored and every query gets the same totals.
+     */
+    GRALLOC_PERFORM_GET_MEMORY = 1
+};
+
+/*****************************************************************************/
+
 #ifdef __cplusplus
 struct private_handle_t : public native_handle {
 #else
@@ -63,7 +85,19 @@ struct private_handle_t {
 #endif
 
     enum {
-        PRIV_FLAGS_FRAMEBUFFER = 0x00000001
+        PRIV_FLAGS_FRAMEBUFFER = 0x00000001,
+        // map huge page aligned, see backing.cpp
+        PRIV_FLAGS_HUGEPAGE    = 0x00000002,
+        // only the CPU writes to the buffer, its last int counts the locks
+        // for writing from other processes, see takeDirtyRect()
+        PRIV_FLAGS_DIRTY_TRACKED = 0x00000004
+    };
+
+    // memory behind the buffer, see backing.cpp
+    enum {
+        BACKING_ASHMEM = 0,
+        BACKING_MEMFD = 1,
+        BACKING_DMABUF = 2
     };
 
     // file-descriptors
@@ -71,21 +105,31 @@ struct private_handle_t {
     // ints
     int     magic;
     int     flags;
+    int     backing;
     int     size;
     int     offset;
+    int     usage;
+    int     format;
+    int     width;
+    int     height;
+    int     stride;
 
     // FIXME: the attributes below should be out-of-line
     int     base;
     int     pid;
+    // allocation id in process 'pid', only a hint: it can be forged
+    int     id;
 
 #ifdef __cplusplus
-    static const int sNumInts = 6;
+    static const int sNumInts = 13;
     static const int sNumFds = 1;
     static const int sMagic = 0x3141592;
 
     private_handle_t(int fd, int size, int flags) :
-        fd(fd), magic(sMagic), flags(flags), size(size), offset(0),
-        base(0), pid(getpid())
+        fd(fd), magic(sMagic), flags(flags), backing(BACKING_ASHMEM),
+        size(size), offset(0),
+        usage(0), format(0), width(0), height(0), stride(0),
+        base(0), pid(getpid()), id(0)
     {
         version = sizeof(native_handle);
         numInts = sNumInts;
@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <string.h>
 
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -31,6 +32,7 @@
 #include <hardware/gralloc.h>
 
 #include "gralloc_priv.h"
+#include "gr.h"
 
 
 /* desktop Linux needs a little help with gettid() */
@@ -43,6 +45,150 @@ pid_t gettid() { return syscall(__NR_gettid);}
 
 /*****************************************************************************/
 
+/*
+ * Each buffer is mapped only once per process, however many handles to it
+ * are registered. The mappings are keyed by the inode of the buffer (see
+ * getBufferKey()); ashmem buffers, which all share the inode of /dev/ashmem,
+ * are further told apart by comparing the file of the handle with the one
+ * kept by the mapping, since anything else in the handle can be forged.
+ * Mappings are reference counted: a buffer is unmapped when its last handle
+ * is unregistered or freed. This avoids both the mmap/munmap churn and the
+ * aliasing of two mappings of the same buffer, which on virtually-indexed
+ * caches (most modern L1 caches) can break memory ordering, when a buffer
+ * comes back to the process that allocated it.
+ */
+
+struct buffer_mapping {
+    buffer_mapping* next;
+    buffer_mapping* nextByBase;
+    buffer_key key;
+    // for CHECK_FILE keys, a duplicate of the file descriptor of the buffer
+    int fd;
+    size_t size;
+    void* base;
+    int refs;
+    // the union of the regions locked for writing since the last call to
+    // takeDirtyRect(), valid once the buffer was locked for writing
+    bool tracked;
+    blit_rect dirty;
+};
+
+#define MAPPING_BUCKETS 64
+
+static pthread_mutex_t sMapLock = PTHREAD_MUTEX_INITIALIZER;
+static buffer_mapping* sMappings[MAPPING_BUCKETS];
+static buffer_mapping* sMappingsByBase[MAPPING_BUCKETS];
+
+static inline buffer_mapping** mappingBucket(const buffer_key& key)
+{
+    size_t hash = (key.ino ^ key.dev) * 31 + key.pid;
+    hash = hash * 31 + key.id;
+    return &sMappings[hash % MAPPING_BUCKETS];
+}
+
+static inline bool sameKey(const buffer_key& a, const buffer_key& b)
+{
+    return a.dev == b.dev && a.ino == b.ino && a.pid == b.pid &&
+            a.id == b.id;
+}
+
+static inline buffer_mapping** mappingBaseBucket(void* base)
+{
+    return &sMappingsByBase[(uintptr_t(base) / PAGE_SIZE) % MAPPING_BUCKETS];
+}
+
+/*
+ * The last int of PRIV_FLAGS_DIRTY_TRACKED buffers, shared by all the
+ * processes, counts the locks for writing from processes other than the
+ * one that allocated the buffer, whose dirty rectangles can't be seen.
+ */
+static inline volatile int32_t* getForeignWrites(private_handle_t const* hnd)
+{
+    return (volatile int32_t*)(hnd->base - hnd->offset + hnd->size -
+            sizeof(int32_t));
+}
+
+/* Must be called with sMapLock held. */
+static buffer_mapping* findMappingByBaseLocked(void* base)
+{
+    for (buffer_mapping* m = *mappingBaseBucket(base); m; m = m->nextByBase) {
+        if (m->base == base)
+            return m;
+    }
+    return NULL;
+}
+
+/* Must be called with sMapLock held. */
+static buffer_mapping* findMappingLocked(const buffer_key& key, size_t size,
+        int fd)
+{
+    if (key.match == buffer_key::NONE)
+        return NULL;
+    for (buffer_mapping* m = *mappingBucket(key); m; m = m->next) {
+        if (sameKey(m->key, key) && m->size == size &&
+                (key.match == buffer_key::UNIQUE ||
+                 isSameBufferFile(m->fd, fd)))
+            return m;
+    }
+    return NULL;
+}
+
+/* Must be called with sMapLock held. */
+static void removeMappingLocked(buffer_mapping* m)
+{
+    for (buffer_mapping** pm = mappingBucket(m->key); *pm;
+            pm = &(*pm)->next) {
+        if (*pm == m) {
+            *pm = m->next;
+            break;
+        }
+    }
+    for (buffer_mapping** pb = mappingBaseBucket(m->base); *pb;
+            pb = &(*pb)->nextByBase) {
+        if (*pb == m) {
+            *pb = m->nextByBase;
+            break;
+        }
+    }
+}
+
+/*****************************************************************************/
+
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+/*
+ * Map a PRIV_FLAGS_HUGEPAGE buffer at a huge page aligned address, which
+ * transparent huge pages require, by carving it out of a larger
+ * reservation, and ask for huge pages.
+ */
+static void* mapHugePageAligned(int fd, size_t size)
+{
+    size_t align = getHugePageSize();
+    void* reserved = mmap(0, size + align, PROT_NONE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED)
+        return MAP_FAILED;
+    uintptr_t start = uintptr_t(reserved);
+    uintptr_t aligned = (start + align - 1) & ~(align - 1);
+    void* base = mmap((void*)aligned, size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_FIXED, fd, 0);
+    if (base == MAP_FAILED) {
+        int err = errno;
+        munmap(reserved, size + align);
+        errno = err;
+        return MAP_FAILED;
+    }
+    if (aligned > start)
+        munmap(reserved, aligned - start);
+    if (start + align > aligned)
+        munmap((void*)(aligned + size), start + align - aligned);
+    // not an error, the kernel may not support huge pages for this memory
+    madvise(base, size, MADV_HUGEPAGE);
+    return base;
+}
+
 static int gralloc_map(gralloc_module_t const* module,
         buffer_handle_t handle,
         void** vaddr)
@@ -50,15 +196,51 @@ static int gralloc_map(gralloc_module_t const* module,
     private_handle_t* hnd = (private_handle_t*)handle;
     if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
         size_t size = hnd->size;
-        void* mappedAddress = mmap(0, size,
-                PROT_READ|PROT_WRITE, MAP_SHARED, hnd->fd, 0);
-        if (mappedAddress == MAP_FAILED) {
-            ALOGE("Could not mmap %s", strerror(errno));
-            return -errno;
+        buffer_key key;
+        int err = getBufferKey(hnd, &key);
+        if (err < 0) {
+            ALOGE("Could not identify buffer %s", strerror(-err));
+            return err;
         }
-        hnd->base = intptr_t(mappedAddress) + hnd->offset;
+
+        pthread_mutex_lock(&sMapLock);
+        buffer_mapping* m = findMappingLocked(key, size, hnd->fd);
+        if (m) {
+            m->refs++;
+        } else {
+            void* mappedAddress;
+            if (hnd->flags & private_handle_t::PRIV_FLAGS_HUGEPAGE) {
+                mappedAddress = mapHugePageAligned(hnd->fd, size);
+            } else {
+                mappedAddress = mmap(0, size,
+                        PROT_READ|PROT_WRITE, MAP_SHARED, hnd->fd, 0);
+            }
+            if (mappedAddress == MAP_FAILED) {
+                int err = -errno;
+                pthread_mutex_unlock(&sMapLock);
+                ALOGE("Could not mmap %s", strerror(-err));
+                return err;
+            }
+            m = new buffer_mapping;
+            m->key = key;
+            m->fd = key.match == buffer_key::CHECK_FILE ?
+                    fcntl(hnd->fd, F_DUPFD_CLOEXEC, 0) : -1;
+            m->size = size;
+            m->base = mappedAddress;
+            m->refs = 1;
+            m->tracked = false;
+            memset(&m->dirty, 0, sizeof(m->dirty));
+            buffer_mapping** bucket = mappingBucket(key);
+            m->next = *bucket;
+            *bucket = m;
+            bucket = mappingBaseBucket(mappedAddress);
+            m->nextByBase = *bucket;
+            *bucket = m;
+        }
+        hnd->base = intptr_t(m->base) + hnd->offset;
+        pthread_mutex_unlock(&sMapLock);
         //ALOGD("gralloc_map() succeeded fd=%d, off=%d, size=%d, vaddr=%p",
-        //        hnd->fd, hnd->offset, hnd->size, mappedAddress);
+        //        hnd->fd, hnd->offset, hnd->size, m->base);
     }
     *vaddr = (void*)hnd->base;
     return 0;
@@ -69,12 +251,34 @@ static int gralloc_unmap(gralloc_module_t const* module,
 {
     private_handle_t* hnd = (private_handle_t*)handle;
     if (!(hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)) {
-        void* base = (void*)hnd->base;
+        void* base = (void*)(hnd->base - hnd->offset);
         size_t size = hnd->size;
+        bool last = false;
+        int fd = -1;
+
+        // the handle may be stale, only the reference count of a mapping
+        // tells when the buffer can be unmapped
+        pthread_mutex_lock(&sMapLock);
+        buffer_mapping* m = findMappingByBaseLocked(base);
+        if (m && m->size == size) {
+            last = --m->refs == 0;
+            if (last) {
+                removeMappingLocked(m);
+                fd = m->fd;
+                delete m;
+            }
+        } else {
+            m = NULL;
+        }
+        pthread_mutex_unlock(&sMapLock);
+
+        ALOGE_IF(!m, "unmapping unknown buffer at %p", base);
         //ALOGD("unmapping from %p, size=%d", base, size);
-        if (munmap(base, size) < 0) {
+        if (last && munmap(base, size) < 0) {
             ALOGE("Could not unmap %s", strerror(errno));
         }
+        if (fd >= 0)
+            close(fd);
     }
     hnd->base = 0;
     return 0;
@@ -82,56 +286,14 @@ static int gralloc_unmap(gralloc_module_t const* module,
 
 /*****************************************************************************/
 
-static pthread_mutex_t sMapLock = PTHREAD_MUTEX_INITIALIZER;
-
-/*****************************************************************************/
-
 int gralloc_register_buffer(gralloc_module_t const* module,
         buffer_handle_t handle)
 {
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
 
-    // *** WARNING WARNING WARNING ***
-    //
-    // If a buffer handle is passed from the process that allocated it to a
-    // different process, and then back to the allocator process, we will
-    // create a second mapping of the buffer. If the process reads and writes
-    // through both mappings, normal memory ordering guarantees may be
-    // violated, depending on the processor cache implementation*.
-    //
-    // If you are deriving a new gralloc implementation from this code, don't
-    // do this. A "real" gralloc should provide a single reference-counted
-    // mapping for each buffer in a process.
-    //
-    // In the current system, there is one case that needs a buffer to be
-    // registered in the same process that allocated it. The SurfaceFlinger
-    // process acts as the IGraphicBufferAlloc Binder provider, so all gralloc
-    // allocations happen in its process. After returning the buffer handle to
-    // the IGraphicBufferAlloc client, SurfaceFlinger free's its handle to the
-    // buffer (unmapping it from the SurfaceFlinger process). If
-    // SurfaceFlinger later acts as the producer end of the buffer queue the
-    // buffer belongs to, it will get a new handle to the buffer in response
-    // to IGraphicBufferProducer::requestBuffer(). Like any buffer handle
-    // received through Binder, the SurfaceFlinger process will register it.
-    // Since it already freed its original handle, it will only end up with
-    // one mapping to the buffer and there will be no problem.
-    //
-    // Currently SurfaceFlinger only acts as a buffer producer for a remote
-    // consumer when taking screenshots and when using virtual displays.
-    //
-    // Eventually, each application should be allowed to make its own gralloc
-    // allocations, solving the problem. Also, this ashmem-based gralloc
-    // should go away, replaced with a real ion-based gralloc.
-    //
-    // * Specifically, associative virtually-indexed caches are likely to have
-    //   problems. Most modern L1 caches fit that description.
-
-    private_handle_t* hnd = (private_handle_t*)handle;
-    ALOGD_IF(hnd->pid == getpid(),
-            "Registering a buffer in the process that created it. "
-            "This may cause memory ordering problems.");
-
+    // A buffer registered in the process that allocated it shares the
+    // mapping made at allocation time, see buffer_mapping above.
     void *vaddr;
     return gralloc_map(module, handle, &vaddr);
 }
@@ -149,6 +311,18 @@ int gralloc_unregister_buffer(gralloc_module_t const* module,
     return 0;
 }
 
+int getMappingCount(private_handle_t const* hnd)
+{
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER || !hnd->base)
+        return 0;
+    pthread_mutex_lock(&sMapLock);
+    buffer_mapping* m = findMappingByBaseLocked(
+            (void*)(hnd->base - hnd->offset));
+    int refs = m ? m->refs : 0;
+    pthread_mutex_unlock(&sMapLock);
+    return refs;
+}
+
 int mapBuffer(gralloc_module_t const* module,
         private_handle_t* hnd)
 {
@@ -167,14 +341,125 @@ int terminateBuffer(gralloc_module_t const* module,
     return 0;
 }
 
+/*
+ * Get ready for the CPU to access the region l,t,w,h of a buffer:
+ *
+ *  - with GRALLOC_USAGE_SW_READ_OFTEN, ask the kernel to fault in the pages
+ *    of the locked rows, and prefetch the first PREFETCH_BYTES of the
+ *    region into the cache,
+ *  - with GRALLOC_USAGE_SW_WRITE_*, add the region to the dirty rectangle
+ *    of the buffer, or count the lock in the buffer when it was allocated
+ *    by another process, see takeDirtyRect().
+ *
+ * An empty region stands for the whole buffer.
+ */
+#define PREFETCH_BYTES  (16 * 1024)
+#define CACHE_LINE_SIZE 64
+
+static void prepareAccess(private_handle_t* hnd, int usage,
+        int l, int t, int w, int h)
+{
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER)
+        return;
+
+    blit_rect rect = { l, t, l + w, t + h };
+    blit_rect bounds = { 0, 0, hnd->width, hnd->height };
+    if (isEmptyRect(bounds)) {
+        // no known dimensions, the whole buffer
+        bounds.r = bounds.b = INT_MAX;
+    }
+    if (isEmptyRect(rect)) {
+        rect = bounds;
+    } else {
+        if (rect.l < 0) rect.l = 0;
+        if (rect.t < 0) rect.t = 0;
+        if (rect.r > bounds.r) rect.r = bounds.r;
+        if (rect.b > bounds.b) rect.b = bounds.b;
+    }
+
+    if ((usage & GRALLOC_USAGE_SW_READ_MASK) == GRALLOC_USAGE_SW_READ_OFTEN) {
+        // the rows of the Y plane for YUV formats
+        size_t bpp = bytesPerPixel(hnd->format);
+        ycbcr_layout layout;
+        if (getYCbCrLayout(hnd->format, hnd->usage, hnd->height, hnd->stride,
+                &layout) == 0)
+            bpp = 1;
+        uintptr_t base = hnd->base;
+        uintptr_t start = base;
+        uintptr_t end = base + hnd->size;
+        size_t rowSize = hnd->stride * bpp;
+        if (rowSize && rect.b != INT_MAX) {
+            start = base + rect.t * rowSize;
+            if (base + rect.b * rowSize < end)
+                end = base + rect.b * rowSize;
+        }
+        start &= ~(PAGE_SIZE - 1);
+        if (start < end)
+            madvise((void*)start, end - start, MADV_WILLNEED);
+
+        if (rowSize && rect.r != INT_MAX) {
+            size_t budget = PREFETCH_BYTES;
+            size_t lineSize = (rect.r - rect.l) * bpp;
+            for (int y = rect.t; y < rect.b && budget; y++) {
+                const char* p = (const char*)base + y * rowSize +
+                        rect.l * bpp;
+                for (size_t x = 0; x < lineSize && budget;
+                        x += CACHE_LINE_SIZE, budget -= CACHE_LINE_SIZE)
+                    __builtin_prefetch(p + x);
+            }
+        }
+    }
+
+    if ((usage & GRALLOC_USAGE_SW_WRITE_MASK) && hnd->pid != getpid()) {
+        if (hnd->flags & private_handle_t::PRIV_FLAGS_DIRTY_TRACKED)
+            android_atomic_inc(getForeignWrites(hnd));
+    } else if (usage & GRALLOC_USAGE_SW_WRITE_MASK) {
+        void* base = (void*)(hnd->base - hnd->offset);
+        pthread_mutex_lock(&sMapLock);
+        buffer_mapping* m = findMappingByBaseLocked(base);
+        if (m) {
+            m->tracked = true;
+            unionRect(&m->dirty, rect);
+        }
+        pthread_mutex_unlock(&sMapLock);
+    }
+}
+
+bool takeDirtyRect(private_handle_t const* hnd, blit_rect* rect)
+{
+    // hardware may write to the buffer, or the locks of the process
+    // that allocated it aren't all seen here
+    if (!(hnd->flags & private_handle_t::PRIV_FLAGS_DIRTY_TRACKED) ||
+            hnd->pid != getpid())
+        return false;
+
+    // take the count first, a lock from another process after this only
+    // affects the next call
+    bool known = android_atomic_and(0, getForeignWrites(hnd)) == 0;
+    void* base = (void*)(hnd->base - hnd->offset);
+    pthread_mutex_lock(&sMapLock);
+    buffer_mapping* m = findMappingByBaseLocked(base);
+    if (m && m->tracked) {
+        *rect = m->dirty;
+        memset(&m->dirty, 0, sizeof(m->dirty));
+    } else {
+        known = false;
+    }
+    pthread_mutex_unlock(&sMapLock);
+    return known;
+}
+
+/*****************************************************************************/
+
 int gralloc_lock(gralloc_module_t const* module,
         buffer_handle_t handle, int usage,
         int l, int t, int w, int h,
         void** vaddr)
 {
     // this is called when a buffer is being locked for software
-    // access. in thin implementation we have nothing to do since
-    // not synchronization with the h/w is needed.
+    // access. in thin implementation no synchronization with the h/w
+    // is needed, we only prepare the locked region for the access
+    // described by the usage bits.
     // typically this is used to wait for the h/w to finish with
     // this buffer if relevant. the data cache may need to be
     // flushed or invalidated depending on the usage bits and the
@@ -184,17 +469,53 @@ int gralloc_lock(gralloc_module_t const* module,
         return -EINVAL;
 
     private_handle_t* hnd = (private_handle_t*)handle;
+    if (hnd->format == HAL_PIXEL_FORMAT_YCbCr_420_888) {
+        // flexible YUV buffers must be locked with lock_ycbcr
+        return -EINVAL;
+    }
+    syncBacking(hnd, true);
+    prepareAccess(hnd, usage, l, t, w, h);
     *vaddr = (void*)hnd->base;
     return 0;
 }
 
+int gralloc_lock_ycbcr(gralloc_module_t const* module,
+        buffer_handle_t handle, int usage,
+        int l, int t, int w, int h,
+        struct android_ycbcr *ycbcr)
+{
+    if (private_handle_t::validate(handle) < 0)
+        return -EINVAL;
+
+    private_handle_t* hnd = (private_handle_t*)handle;
+    ycbcr_layout layout;
+    if (getYCbCrLayout(hnd->format, hnd->usage, hnd->height, hnd->stride,
+            &layout) < 0)
+        return -EINVAL;
+
+    syncBacking(hnd, true);
+    prepareAccess(hnd, usage, l, t, w, h);
+    char* base = (char*)hnd->base;
+    ycbcr->y = base;
+    ycbcr->cb = base + layout.cbOffset;
+    ycbcr->cr = base + layout.crOffset;
+    ycbcr->ystride = layout.yStride;
+    ycbcr->cstride = layout.cStride;
+    ycbcr->chroma_step = layout.chromaStep;
+    memset(ycbcr->reserved, 0, sizeof(ycbcr->reserved));
+    return 0;
+}
+
 int gralloc_unlock(gralloc_module_t const* module,
         buffer_handle_t handle)
 {
-    // we're done with a software buffer. nothing to do in this
-    // implementation. typically this is used to flush the data cache.
+    // we're done with a software buffer. typically this is used to flush
+    // the data cache, only dma-buf exporters need to be told about it here.
 
     if (private_handle_t::validate(handle) < 0)
         return -EINVAL;
+
+    private_handle_t* hnd = (private_handle_t*)handle;
+    syncBacking(hnd, false);
     return 0;
 }
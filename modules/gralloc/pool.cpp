@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include "gralloc_priv.h"
+#include "gr.h"
+
+/*****************************************************************************/
+
+/*
+ * Recently freed buffers are kept, still mapped, along with their handle and
+ * ashmem region, and handed out again, zeroed, to allocations of the same
+ * size and usage.
+ *
+ * The pool is disabled unless PROP_MAX_BYTES is set: a buffer may still be
+ * mapped by another process when it is freed here, and that process would
+ * then see the contents of the next buffer allocated from the same region.
+ * Only enable it where buffers are released by their consumers before they
+ * are freed by the allocator.
+ *
+ * Buffers are evicted, oldest first, when the pool holds more than
+ * PROP_MAX_BUFFERS buffers or PROP_MAX_BYTES bytes, when they have been
+ * pooled for longer than PROP_MAX_AGE_MS, and all at once when an
+ * allocation fails.
+ */
+
+#define PROP_MAX_BYTES      "ro.gralloc.pool.max_bytes"
+#define PROP_MAX_BUFFERS    "ro.gralloc.pool.max_buffers"
+#define PROP_MAX_AGE_MS     "ro.gralloc.pool.max_age_ms"
+
+#define DEFAULT_MAX_BUFFERS 16
+#define DEFAULT_MAX_AGE_MS  2000
+
+/* Upper bound of PROP_MAX_BUFFERS */
+#define POOL_CAPACITY       64
+
+struct pool_entry {
+    gralloc_module_t const* module;
+    private_handle_t* hnd;
+    int usage;
+    int64_t freed;
+};
+
+struct buffer_pool {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    size_t maxBytes;
+    size_t maxBuffers;
+    int64_t maxAge;
+    size_t count;
+    pool_entry entries[POOL_CAPACITY];
+    gralloc_pool_stats stats;
+};
+
+static buffer_pool sPool = {
+    lock: PTHREAD_MUTEX_INITIALIZER,
+    once: PTHREAD_ONCE_INIT,
+};
+
+/*****************************************************************************/
+
+static void poolInit()
+{
+    sPool.maxBytes = getLongProperty(PROP_MAX_BYTES, 0);
+    sPool.maxBuffers = getLongProperty(PROP_MAX_BUFFERS, DEFAULT_MAX_BUFFERS);
+    if (sPool.maxBuffers > POOL_CAPACITY)
+        sPool.maxBuffers = POOL_CAPACITY;
+    sPool.maxAge = getLongProperty(PROP_MAX_AGE_MS, DEFAULT_MAX_AGE_MS)
+            * 1000000LL;
+    ALOGD_IF(sPool.maxBytes, "buffer pool: %zu bytes, %zu buffers, %lld ms",
+            sPool.maxBytes, sPool.maxBuffers,
+            (long long)(sPool.maxAge / 1000000));
+}
+
+static void releaseEntry(const pool_entry& e)
+{
+    terminateBuffer(e.module, e.hnd);
+    close(e.hnd->fd);
+    delete e.hnd;
+}
+
+/* Must be called with sPool.lock held. */
+static void removeEntryLocked(size_t i, pool_entry* removed)
+{
+    *removed = sPool.entries[i];
+    sPool.stats.retainedBytes -= removed->hnd->size;
+    sPool.stats.retainedBuffers--;
+    // keep the entries ordered from the oldest to the most recent
+    memmove(&sPool.entries[i], &sPool.entries[i + 1],
+            (sPool.count - i - 1) * sizeof(pool_entry));
+    sPool.count--;
+}
+
+/*
+ * Move the entries that must be evicted, so that 'buffers' more buffers of
+ * 'bytes' bytes in total fit in the pool, to 'evicted'.
+ * Must be called with sPool.lock held.
+ */
+static size_t evictLocked(size_t buffers, size_t bytes, int64_t time,
+        pool_entry* evicted)
+{
+    size_t n = 0;
+    while (sPool.count > 0 &&
+            (sPool.count + buffers > sPool.maxBuffers ||
+             sPool.stats.retainedBytes + bytes > sPool.maxBytes ||
+             time - sPool.entries[0].freed > sPool.maxAge)) {
+        removeEntryLocked(0, &evicted[n++]);
+        sPool.stats.evictions++;
+    }
+    return n;
+}
+
+/*****************************************************************************/
+
+private_handle_t* gralloc_pool_take(size_t size, int usage)
+{
+    pthread_once(&sPool.once, poolInit);
+    if (!sPool.maxBytes)
+        return NULL;
+
+    pool_entry e;
+    pool_entry evicted[POOL_CAPACITY];
+    bool found = false;
+
+    pthread_mutex_lock(&sPool.lock);
+    size_t n = evictLocked(0, 0, now_ns(), evicted);
+    // most recently freed first, its pages are the most likely to be hot
+    for (size_t i = sPool.count; i-- > 0 ;) {
+        const pool_entry& c = sPool.entries[i];
+        if (size_t(c.hnd->size) == size && c.usage == usage) {
+            removeEntryLocked(i, &e);
+            found = true;
+            break;
+        }
+    }
+    if (found)
+        sPool.stats.hits++;
+    else
+        sPool.stats.misses++;
+    pthread_mutex_unlock(&sPool.lock);
+
+    for (size_t i = 0; i < n; i++)
+        releaseEntry(evicted[i]);
+    if (!found)
+        return NULL;
+
+    memset((void*)e.hnd->base, 0, e.hnd->size);
+    return e.hnd;
+}
+
+bool gralloc_pool_give(gralloc_module_t const* module, private_handle_t* hnd,
+        int usage)
+{
+    pthread_once(&sPool.once, poolInit);
+    size_t size = hnd->size;
+    if (size > sPool.maxBytes || !sPool.maxBuffers || !hnd->base)
+        return false;
+
+    pool_entry evicted[POOL_CAPACITY];
+    int64_t time = now_ns();
+
+    pthread_mutex_lock(&sPool.lock);
+    size_t n = evictLocked(1, size, time, evicted);
+    pool_entry& e = sPool.entries[sPool.count++];
+    e.module = module;
+    e.hnd = hnd;
+    e.usage = usage;
+    e.freed = time;
+    sPool.stats.retainedBytes += size;
+    sPool.stats.retainedBuffers++;
+    pthread_mutex_unlock(&sPool.lock);
+
+    for (size_t i = 0; i < n; i++)
+        releaseEntry(evicted[i]);
+    return true;
+}
+
+void gralloc_pool_trim()
+{
+    pool_entry evicted[POOL_CAPACITY];
+    size_t n;
+
+    pthread_mutex_lock(&sPool.lock);
+    n = sPool.count;
+    memcpy(evicted, sPool.entries, n * sizeof(pool_entry));
+    sPool.count = 0;
+    sPool.stats.retainedBytes = 0;
+    sPool.stats.retainedBuffers = 0;
+    sPool.stats.evictions += n;
+    pthread_mutex_unlock(&sPool.lock);
+
+    for (size_t i = 0; i < n; i++)
+        releaseEntry(evicted[i]);
+    ALOGD_IF(n, "buffer pool: trimmed %zu buffers", n);
+}
+
+void gralloc_pool_get_stats(gralloc_pool_stats* stats)
+{
+    pthread_mutex_lock(&sPool.lock);
+    *stats = sPool.stats;
+    pthread_mutex_unlock(&sPool.lock);
+}
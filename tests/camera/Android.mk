@@ -0,0 +1,29 @@
+LOCAL_PATH:= $(call my-dir)
+
+# camera_request_queue_test links the request queue sources of the default
+# camera HAL, it runs on the device and on the host.
+camera_module_src_files := \
+	RequestQueue.cpp
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := request_queue_test.cpp \
+	$(addprefix ../../modules/camera/,$(camera_module_src_files))
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../../modules/camera \
+	system/media/camera/include
+LOCAL_SHARED_LIBRARIES := libcamera_metadata liblog libcutils
+LOCAL_MODULE := camera_request_queue_test
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := request_queue_test.cpp \
+	$(addprefix ../../modules/camera/,$(camera_module_src_files))
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/../../modules/camera \
+	system/media/camera/include
+LOCAL_STATIC_LIBRARIES := libcamera_metadata libcutils liblog
+LOCAL_LDLIBS := -lpthread
+LOCAL_MODULE := camera_request_queue_test
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Test of the request queues and request pool of the default camera HAL's
+ * capture pipeline. Checks that:
+ *
+ *  - a queue hands out its requests in order, and the requests pushed
+ *    before close() before returning NULL,
+ *  - a reopened queue accepts requests again,
+ *  - the pool hands out each of its requests once, and get() waits for
+ *    put() when they are all in use,
+ *  - closing the stages of a pipeline in order, as the camera does when
+ *    it is closed, delivers every request queued, in order.
+ *
+ * usage: camera_request_queue_test
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "RequestQueue.h"
+
+using namespace default_camera_hal;
+
+#define NUM_REQUESTS    8
+#define NUM_BUFFERS     3
+#define NUM_STAGES      3
+
+static int sFailures;
+
+#define CHECK(cond) do {                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond);\
+            sFailures++;                                                    \
+        }                                                                   \
+    } while (0)
+
+static void testQueueOrder()
+{
+    CaptureRequest requests[NUM_REQUESTS];
+    RequestQueue queue;
+
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        requests[i].mFrameNumber = i;
+        queue.push(&requests[i]);
+    }
+    queue.close();
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        CaptureRequest *r = queue.pop();
+        CHECK(r == &requests[i]);
+    }
+    CHECK(queue.pop() == NULL);
+
+    queue.reopen();
+    queue.push(&requests[0]);
+    CHECK(queue.pop() == &requests[0]);
+    queue.close();
+    CHECK(queue.pop() == NULL);
+}
+
+static void *getOne(void *data)
+{
+    return static_cast<RequestPool*>(data)->get();
+}
+
+static void testPool()
+{
+    RequestPool pool;
+    CaptureRequest *taken[NUM_REQUESTS];
+
+    CHECK(pool.resize(NUM_REQUESTS, NUM_BUFFERS) == 0);
+    CHECK(pool.getMaxBuffers() == NUM_BUFFERS);
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        taken[i] = pool.get();
+        CHECK(taken[i] != NULL);
+        for (int j = 0; j < i; j++) {
+            CHECK(taken[j] != taken[i]);
+            // the buffers of the requests don't overlap
+            CHECK(taken[j]->mBuffers + NUM_BUFFERS <= taken[i]->mBuffers ||
+                    taken[i]->mBuffers + NUM_BUFFERS <= taken[j]->mBuffers);
+        }
+    }
+
+    // all the requests are in use, get() waits for one to be put back
+    pthread_t thread;
+    pthread_create(&thread, NULL, getOne, &pool);
+    usleep(10000);
+    pool.put(taken[3]);
+    void *got;
+    pthread_join(thread, &got);
+    CHECK(got == taken[3]);
+
+    for (int i = 0; i < NUM_REQUESTS; i++)
+        pool.put(taken[i]);
+    CHECK(pool.resize(0, 0) == 0);
+    CHECK(pool.get() == NULL);
+}
+
+// One stage of the pipeline: pass the requests of 'in' to 'out'
+struct stage {
+    RequestQueue *in;
+    RequestQueue *out;
+};
+
+static void *runStage(void *data)
+{
+    stage *s = static_cast<stage*>(data);
+    CaptureRequest *r;
+    while ((r = s->in->pop()) != NULL)
+        s->out->push(r);
+    return NULL;
+}
+
+static void testPipelineDrain()
+{
+    CaptureRequest requests[NUM_REQUESTS];
+    RequestQueue queues[NUM_STAGES + 1];
+    stage stages[NUM_STAGES];
+    pthread_t threads[NUM_STAGES];
+
+    for (int i = 0; i < NUM_STAGES; i++) {
+        stages[i].in = &queues[i];
+        stages[i].out = &queues[i + 1];
+        pthread_create(&threads[i], NULL, runStage, &stages[i]);
+    }
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        requests[i].mFrameNumber = i;
+        queues[0].push(&requests[i]);
+    }
+    // as Camera::stopPipeline() does: each stage completes the requests
+    // queued before it is closed
+    for (int i = 0; i < NUM_STAGES; i++) {
+        queues[i].close();
+        pthread_join(threads[i], NULL);
+    }
+    queues[NUM_STAGES].close();
+    for (int i = 0; i < NUM_REQUESTS; i++) {
+        CaptureRequest *r = queues[NUM_STAGES].pop();
+        CHECK(r == &requests[i]);
+    }
+    CHECK(queues[NUM_STAGES].pop() == NULL);
+}
+
+int main()
+{
+    testQueueOrder();
+    testPool();
+    testPipelineDrain();
+
+    printf("%s\n", sFailures ? "FAILED" : "PASSED");
+    return sFailures ? 1 : 0;
+}
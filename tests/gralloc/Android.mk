@@ -0,0 +1,53 @@
+LOCAL_PATH:= $(call my-dir)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := gralloc_benchmark.cpp
+LOCAL_SHARED_LIBRARIES := libcutils libhardware
+LOCAL_MODULE := gralloc_benchmark
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := gralloc_fb_stress.cpp
+LOCAL_SHARED_LIBRARIES := libcutils libhardware
+LOCAL_MODULE := gralloc_fb_stress
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := gralloc_hugepage_benchmark.cpp
+LOCAL_SHARED_LIBRARIES := libcutils libhardware
+LOCAL_MODULE := gralloc_hugepage_benchmark
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
+
+# gralloc_backing_test runs on the device against the gralloc module, and
+# on the host with the module sources linked in.
+gralloc_module_src_files := \
+	gralloc.cpp \
+	framebuffer.cpp \
+	mapper.cpp \
+	pool.cpp \
+	blit.cpp \
+	frame_stats.cpp \
+	backing.cpp \
+	alloc_table.cpp
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := gralloc_backing_test.cpp
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../../modules/gralloc
+LOCAL_SHARED_LIBRARIES := liblog libcutils libhardware
+LOCAL_MODULE := gralloc_backing_test
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := gralloc_backing_test.cpp \
+	$(addprefix ../../modules/gralloc/,$(gralloc_module_src_files))
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../../modules/gralloc
+LOCAL_CFLAGS := -DLOG_TAG=\"gralloc\"
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+LOCAL_MODULE := gralloc_backing_test
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_HOST_EXECUTABLE)
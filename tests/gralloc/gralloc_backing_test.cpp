@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Test of the memory behind gralloc buffers and of their mappings.
+ *
+ * Allocates buffers with the backing listed first in ro.gralloc.backing,
+ * memfd on the host, and checks that:
+ *
+ *  - memfd buffers are sealed against resizing,
+ *  - a copy of a handle, as another process would receive it, shares the
+ *    mapping of the buffer and sees its contents,
+ *  - a handle carrying the id of a buffer but the memory of another one
+ *    does not alias the first buffer,
+ *  - unregistering a handle whose fd was already closed leaves the buffer
+ *    mapped for its other handles.
+ *
+ * The host build links the gralloc sources in; on the device the module is
+ * loaded with hw_get_module().
+ *
+ * usage: gralloc_backing_test
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <hardware/gralloc.h>
+
+#include "gralloc_priv.h"
+
+#ifndef F_GET_SEALS
+#define F_GET_SEALS         (1024 + 10)
+#define F_SEAL_SHRINK       0x0002
+#define F_SEAL_GROW         0x0004
+#endif
+
+#define WIDTH   64
+#define HEIGHT  64
+
+#if !HAVE_ANDROID_OS
+extern struct private_module_t HAL_MODULE_INFO_SYM;
+#endif
+
+static int sFailures;
+
+#define CHECK(cond) do {                                                    \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond);\
+            sFailures++;                                                    \
+        }                                                                   \
+    } while (0)
+
+static const gralloc_module_t* getModule()
+{
+#if HAVE_ANDROID_OS
+    const hw_module_t* module;
+    if (hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module))
+        return NULL;
+    return (const gralloc_module_t*)module;
+#else
+    return &HAL_MODULE_INFO_SYM.base;
+#endif
+}
+
+// A handle to the buffer of 'fd' as another process would receive it:
+// the ints of 'hnd' with a file descriptor of its own.
+static private_handle_t* importHandle(const private_handle_t* hnd, int fd)
+{
+    private_handle_t* copy = new private_handle_t(fd, hnd->size, hnd->flags);
+    copy->backing = hnd->backing;
+    copy->usage = hnd->usage;
+    copy->format = hnd->format;
+    copy->width = hnd->width;
+    copy->height = hnd->height;
+    copy->stride = hnd->stride;
+    copy->pid = hnd->pid;
+    copy->id = hnd->id;
+    return copy;
+}
+
+static void testSeals(const private_handle_t* hnd)
+{
+    if (hnd->backing != private_handle_t::BACKING_MEMFD) {
+        printf("buffers aren't backed by memfd, not testing the seals\n");
+        return;
+    }
+    int seals = fcntl(hnd->fd, F_GET_SEALS);
+    CHECK(seals >= 0);
+    CHECK((seals & (F_SEAL_SHRINK | F_SEAL_GROW)) ==
+            (F_SEAL_SHRINK | F_SEAL_GROW));
+    CHECK(ftruncate(hnd->fd, hnd->size / 2) < 0 && errno == EPERM);
+    CHECK(ftruncate(hnd->fd, hnd->size * 2) < 0 && errno == EPERM);
+}
+
+static void testImport(const gralloc_module_t* module,
+        const private_handle_t* hnd)
+{
+    private_handle_t* copy = importHandle(hnd, dup(hnd->fd));
+    CHECK(module->registerBuffer(module, copy) == 0);
+    CHECK(copy->base == hnd->base);
+    if (copy->base) {
+        ((volatile uint8_t*)hnd->base)[1] = 0x5a;
+        CHECK(((volatile uint8_t*)copy->base)[1] == 0x5a);
+    }
+    CHECK(module->unregisterBuffer(module, copy) == 0);
+    close(copy->fd);
+    delete copy;
+}
+
+static void testForgedId(const gralloc_module_t* module,
+        const private_handle_t* hnd, const private_handle_t* other)
+{
+    // the id of 'hnd' but the memory of 'other'
+    private_handle_t* forged = importHandle(hnd, dup(other->fd));
+    CHECK(module->registerBuffer(module, forged) == 0);
+    CHECK(forged->base != hnd->base);
+    if (forged->base) {
+        ((volatile uint8_t*)other->base)[2] = 0xa5;
+        ((volatile uint8_t*)hnd->base)[2] = 0;
+        CHECK(((volatile uint8_t*)forged->base)[2] == 0xa5);
+    }
+    CHECK(module->unregisterBuffer(module, forged) == 0);
+    close(forged->fd);
+    delete forged;
+}
+
+static void testClosedFd(const gralloc_module_t* module,
+        const private_handle_t* hnd)
+{
+    private_handle_t* copy = importHandle(hnd, dup(hnd->fd));
+    CHECK(module->registerBuffer(module, copy) == 0);
+    close(copy->fd);
+    CHECK(module->unregisterBuffer(module, copy) == 0);
+    delete copy;
+
+    // the buffer must still be mapped, or this crashes
+    ((volatile uint8_t*)hnd->base)[3] = 0x3c;
+    CHECK(((volatile uint8_t*)hnd->base)[3] == 0x3c);
+}
+
+int main()
+{
+    const gralloc_module_t* module = getModule();
+    if (!module) {
+        fprintf(stderr, "cannot load the gralloc module\n");
+        return 1;
+    }
+    hw_device_t* device;
+    int err = module->common.methods->open(&module->common,
+            GRALLOC_HARDWARE_GPU0, &device);
+    if (err) {
+        fprintf(stderr, "cannot open the allocator: %s\n", strerror(-err));
+        return 1;
+    }
+    alloc_device_t* alloc = (alloc_device_t*)device;
+
+    int usage = GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN;
+    buffer_handle_t handles[2];
+    int stride;
+    for (int i = 0; i < 2; i++) {
+        err = alloc->alloc(alloc, WIDTH, HEIGHT, HAL_PIXEL_FORMAT_RGBA_8888,
+                usage, &handles[i], &stride);
+        if (err) {
+            fprintf(stderr, "cannot allocate a buffer: %s\n", strerror(-err));
+            return 1;
+        }
+    }
+    const private_handle_t* hnd = (const private_handle_t*)handles[0];
+    const private_handle_t* other = (const private_handle_t*)handles[1];
+
+    testSeals(hnd);
+    testImport(module, hnd);
+    testForgedId(module, hnd, other);
+    testClosedFd(module, hnd);
+
+    for (int i = 0; i < 2; i++)
+        alloc->free(alloc, handles[i]);
+    gralloc_close(alloc);
+
+    printf("%s\n", sFailures ? "FAILED" : "PASSED");
+    return sFailures ? 1 : 0;
+}
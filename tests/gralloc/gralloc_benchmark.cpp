@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures the effect of the row alignment of gralloc buffers on software
+ * rendering.
+ *
+ * Pairs of buffers of a few awkward widths are allocated once with
+ * GRALLOC_USAGE_SW_*_RARELY, which gets the default 4-byte row alignment,
+ * and once with GRALLOC_USAGE_SW_*_OFTEN, which gets the cache line
+ * alignment (see ro.gralloc.row_align.sw_often). For each pair, this times
+ * a row by row copy and a source-over blend from one buffer to the other.
+ *
+ * usage: gralloc_benchmark [<iterations>]
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <hardware/gralloc.h>
+
+#define DEFAULT_ITERATIONS 50
+
+struct test_size {
+    int width;
+    int height;
+};
+
+static const test_size sizes[] = {
+    { 1279, 720 },
+    { 1917, 1080 },
+    { 641, 479 },
+};
+
+static const int formats[] = {
+    HAL_PIXEL_FORMAT_RGBA_8888,
+    HAL_PIXEL_FORMAT_RGB_888,
+    HAL_PIXEL_FORMAT_RGB_565,
+};
+
+struct test_buffer {
+    buffer_handle_t handle;
+    int stride;
+    uint8_t* base;
+};
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+static int bytesPerPixel(int format)
+{
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+            return 4;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            return 3;
+        default:
+            return 2;
+    }
+}
+
+static void copyRows(const test_buffer& dst, const test_buffer& src,
+        int width, int height, int bpp)
+{
+    for (int y = 0; y < height; y++) {
+        memcpy(dst.base + size_t(y) * dst.stride * bpp,
+               src.base + size_t(y) * src.stride * bpp, width * bpp);
+    }
+}
+
+/* src-over of premultiplied pixels, the alpha of RGB formats is 0x80 */
+static void blendRows(const test_buffer& dst, const test_buffer& src,
+        int width, int height, int bpp)
+{
+    for (int y = 0; y < height; y++) {
+        uint8_t* d = dst.base + size_t(y) * dst.stride * bpp;
+        const uint8_t* s = src.base + size_t(y) * src.stride * bpp;
+        for (int x = 0; x < width * bpp; x += bpp) {
+            unsigned a = (bpp == 4) ? s[x + 3] : 0x80;
+            for (int c = 0; c < bpp; c++)
+                d[x + c] = s[x + c] + ((d[x + c] * (255 - a)) >> 8);
+        }
+    }
+}
+
+static int allocBuffer(alloc_device_t* alloc, gralloc_module_t const* module,
+        int width, int height, int format, int usage, test_buffer* buffer)
+{
+    int err = alloc->alloc(alloc, width, height, format, usage,
+            &buffer->handle, &buffer->stride);
+    if (err < 0)
+        return err;
+    void* vaddr;
+    err = module->lock(module, buffer->handle, usage, 0, 0, width, height,
+            &vaddr);
+    if (err < 0) {
+        alloc->free(alloc, buffer->handle);
+        return err;
+    }
+    buffer->base = (uint8_t*)vaddr;
+    memset(buffer->base, 0x5a, size_t(buffer->stride) * height *
+            bytesPerPixel(format));
+    return 0;
+}
+
+static void freeBuffer(alloc_device_t* alloc, gralloc_module_t const* module,
+        test_buffer* buffer)
+{
+    module->unlock(module, buffer->handle);
+    alloc->free(alloc, buffer->handle);
+}
+
+static double mbPerSecond(int64_t bytes, int64_t ns)
+{
+    return ns ? double(bytes) * 1000.0 / ns : 0;
+}
+
+static void runTest(alloc_device_t* alloc, gralloc_module_t const* module,
+        const test_size& size, int format, bool often, int iterations)
+{
+    int usage = often ?
+            GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN :
+            GRALLOC_USAGE_SW_READ_RARELY | GRALLOC_USAGE_SW_WRITE_RARELY;
+    int bpp = bytesPerPixel(format);
+    test_buffer src, dst;
+
+    if (allocBuffer(alloc, module, size.width, size.height, format, usage,
+            &src) < 0) {
+        fprintf(stderr, "cannot allocate %dx%d buffer\n",
+                size.width, size.height);
+        return;
+    }
+    if (allocBuffer(alloc, module, size.width, size.height, format, usage,
+            &dst) < 0) {
+        fprintf(stderr, "cannot allocate %dx%d buffer\n",
+                size.width, size.height);
+        freeBuffer(alloc, module, &src);
+        return;
+    }
+
+    int64_t bytes = int64_t(size.width) * size.height * bpp * iterations;
+    int64_t start = now_ns();
+    for (int i = 0; i < iterations; i++)
+        copyRows(dst, src, size.width, size.height, bpp);
+    int64_t copyNs = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++)
+        blendRows(dst, src, size.width, size.height, bpp);
+    int64_t blendNs = now_ns() - start;
+
+    printf("%5dx%-5d %d bpp %-6s stride %5d  copy %8.1f MB/s  "
+            "blend %8.1f MB/s\n", size.width, size.height, bpp,
+            often ? "often" : "rarely", src.stride,
+            mbPerSecond(bytes, copyNs), mbPerSecond(bytes, blendNs));
+
+    freeBuffer(alloc, module, &dst);
+    freeBuffer(alloc, module, &src);
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    hw_module_t const* module;
+    alloc_device_t* alloc;
+    int err;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [<iterations>]\n", argv[0]);
+        return 1;
+    }
+
+    err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module);
+    if (err < 0) {
+        fprintf(stderr, "cannot load gralloc: %s\n", strerror(-err));
+        return 1;
+    }
+    err = gralloc_open(module, &alloc);
+    if (err < 0) {
+        fprintf(stderr, "cannot open gralloc: %s\n", strerror(-err));
+        return 1;
+    }
+
+    gralloc_module_t const* gralloc = (gralloc_module_t const*)module;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (size_t j = 0; j < sizeof(formats) / sizeof(formats[0]); j++) {
+            runTest(alloc, gralloc, sizes[i], formats[j], false, iterations);
+            runTest(alloc, gralloc, sizes[i], formats[j], true, iterations);
+        }
+    }
+
+    gralloc_close(alloc);
+    return 0;
+}
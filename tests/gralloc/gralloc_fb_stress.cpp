@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Stress test of the allocation of framebuffer buffers from many threads.
+ *
+ * Each thread allocates GRALLOC_USAGE_HW_FB buffers and frees them in a
+ * loop. A buffer is identified by the address gralloc maps it at; the test
+ * fails if two threads hold a buffer at the same address at once, or if
+ * some framebuffer buffers can't be allocated anymore once all threads are
+ * done.
+ *
+ * Run it while nothing else uses the framebuffer, e.g. after "adb shell
+ * stop".
+ *
+ * usage: gralloc_fb_stress [<threads> [<iterations>]]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <hardware/gralloc.h>
+#include <hardware/fb.h>
+
+#define DEFAULT_THREADS     8
+#define DEFAULT_ITERATIONS  100000
+#define MAX_BUFFERS         32
+
+struct test_state {
+    const gralloc_module_t* module;
+    alloc_device_t* alloc;
+    int width;
+    int height;
+    int format;
+    int iterations;
+
+    // addresses of the buffers held by the threads
+    pthread_mutex_t lock;
+    void* held[MAX_BUFFERS];
+
+    volatile int32_t allocations;
+    volatile int32_t exhausted;
+    volatile int32_t failures;
+};
+
+static test_state sState;
+
+// Record that a thread holds the buffer at 'vaddr'. Returns -EEXIST if
+// another thread already holds it, -ENOSPC if MAX_BUFFERS buffers are held.
+static int hold(void* vaddr)
+{
+    int err = 0;
+    int free = -1;
+    pthread_mutex_lock(&sState.lock);
+    for (int i = 0; i < MAX_BUFFERS; i++) {
+        if (sState.held[i] == vaddr)
+            err = -EEXIST;
+        else if (!sState.held[i] && free < 0)
+            free = i;
+    }
+    if (!err && free < 0)
+        err = -ENOSPC;
+    if (!err)
+        sState.held[free] = vaddr;
+    pthread_mutex_unlock(&sState.lock);
+    return err;
+}
+
+static void release(void* vaddr)
+{
+    pthread_mutex_lock(&sState.lock);
+    for (int i = 0; i < MAX_BUFFERS; i++) {
+        if (sState.held[i] == vaddr)
+            sState.held[i] = NULL;
+    }
+    pthread_mutex_unlock(&sState.lock);
+}
+
+static void* stressThread(void*)
+{
+    for (int i = 0; i < sState.iterations; i++) {
+        buffer_handle_t handle;
+        int stride;
+        int err = sState.alloc->alloc(sState.alloc, sState.width,
+                sState.height, sState.format, GRALLOC_USAGE_HW_FB,
+                &handle, &stride);
+        if (err == -ENOMEM) {
+            __sync_fetch_and_add(&sState.exhausted, 1);
+            continue;
+        }
+        if (err < 0) {
+            fprintf(stderr, "alloc failed: %s\n", strerror(-err));
+            __sync_fetch_and_add(&sState.failures, 1);
+            return NULL;
+        }
+        __sync_fetch_and_add(&sState.allocations, 1);
+
+        // held from the allocation to the free, however long the lock
+        // and unlock take in between
+        void* vaddr = NULL;
+        sState.module->lock(sState.module, handle,
+                GRALLOC_USAGE_SW_WRITE_RARELY, 0, 0, sState.width,
+                sState.height, &vaddr);
+        err = hold(vaddr);
+        if (err == -EEXIST) {
+            fprintf(stderr, "buffer at %p allocated twice\n", vaddr);
+            __sync_fetch_and_add(&sState.failures, 1);
+        } else if (err == -ENOSPC) {
+            fprintf(stderr, "more than %d buffers held\n", MAX_BUFFERS);
+            __sync_fetch_and_add(&sState.failures, 1);
+        }
+        sState.module->unlock(sState.module, handle);
+        if (err == 0)
+            release(vaddr);
+        sState.alloc->free(sState.alloc, handle);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    int threads = argc > 1 ? atoi(argv[1]) : DEFAULT_THREADS;
+    sState.iterations = argc > 2 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    if (threads <= 0 || sState.iterations <= 0) {
+        fprintf(stderr, "usage: %s [<threads> [<iterations>]]\n", argv[0]);
+        return 1;
+    }
+
+    hw_module_t const* module;
+    framebuffer_device_t* fb;
+    int err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module);
+    if (err < 0) {
+        fprintf(stderr, "cannot load gralloc: %s\n", strerror(-err));
+        return 1;
+    }
+    err = framebuffer_open(module, &fb);
+    if (err < 0) {
+        fprintf(stderr, "cannot open the framebuffer: %s\n", strerror(-err));
+        return 1;
+    }
+    err = gralloc_open(module, &sState.alloc);
+    if (err < 0) {
+        fprintf(stderr, "cannot open gralloc: %s\n", strerror(-err));
+        return 1;
+    }
+
+    sState.module = (const gralloc_module_t*)module;
+    sState.width = fb->width;
+    sState.height = fb->height;
+    sState.format = fb->format;
+    pthread_mutex_init(&sState.lock, NULL);
+    printf("%d framebuffer buffers, %d threads, %d iterations\n",
+            fb->numFramebuffers, threads, sState.iterations);
+
+    pthread_t* tids = new pthread_t[threads];
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, stressThread, NULL);
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    delete[] tids;
+
+    // every buffer must have been returned
+    buffer_handle_t handles[MAX_BUFFERS];
+    int count = 0;
+    while (count < MAX_BUFFERS) {
+        int stride;
+        if (sState.alloc->alloc(sState.alloc, sState.width, sState.height,
+                sState.format, GRALLOC_USAGE_HW_FB, &handles[count],
+                &stride) < 0) {
+            break;
+        }
+        count++;
+    }
+    for (int i = 0; i < count; i++)
+        sState.alloc->free(sState.alloc, handles[i]);
+    if (fb->numFramebuffers > 1 && count != fb->numFramebuffers) {
+        fprintf(stderr, "%d buffers left out of %d\n", count,
+                fb->numFramebuffers);
+        sState.failures++;
+    }
+
+    printf("%d allocations, %d exhausted, %d failures\n",
+            sState.allocations, sState.exhausted, sState.failures);
+
+    gralloc_close(sState.alloc);
+    framebuffer_close(fb);
+    return sState.failures ? 1 : 0;
+}
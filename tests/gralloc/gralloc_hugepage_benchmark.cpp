@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures the effect of huge pages on software walks of large buffers.
+ *
+ * Each size is allocated once from gralloc, which backs buffers above
+ * ro.gralloc.hugepage_threshold with huge pages when it can, and once as a
+ * plain ashmem region mapped with 4 KiB pages, as gralloc did before. Both
+ * are read row by row, as a filter would, and in 32x32 pixel tiles visited
+ * column by column, as a rotation would, which touches a different page
+ * with every row of every tile.
+ *
+ * The page size column is the one reported by /proc/self/smaps for the
+ * gralloc mapping: "thp" when transparent huge pages back part of it.
+ *
+ * usage: gralloc_hugepage_benchmark [<iterations>]
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <cutils/ashmem.h>
+#include <hardware/gralloc.h>
+
+#define DEFAULT_ITERATIONS 10
+#define TILE_SIZE 32
+
+struct test_size {
+    int width;
+    int height;
+};
+
+static const test_size sizes[] = {
+    { 1920, 1080 },
+    { 3840, 2160 },
+    { 4096, 3072 },
+};
+
+struct test_buffer {
+    uint32_t* base;
+    int stride;
+};
+
+static int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+static uint32_t rowWalk(const test_buffer& b, int width, int height)
+{
+    uint32_t sum = 0;
+    for (int y = 0; y < height; y++) {
+        const uint32_t* row = b.base + size_t(y) * b.stride;
+        for (int x = 0; x < width; x++)
+            sum += row[x];
+    }
+    return sum;
+}
+
+static uint32_t tileWalk(const test_buffer& b, int width, int height)
+{
+    uint32_t sum = 0;
+    for (int tx = 0; tx < width; tx += TILE_SIZE) {
+        int tw = width - tx < TILE_SIZE ? width - tx : TILE_SIZE;
+        for (int ty = 0; ty < height; ty += TILE_SIZE) {
+            int th = height - ty < TILE_SIZE ? height - ty : TILE_SIZE;
+            for (int y = ty; y < ty + th; y++) {
+                const uint32_t* row = b.base + size_t(y) * b.stride + tx;
+                for (int x = 0; x < tw; x++)
+                    sum += row[x];
+            }
+        }
+    }
+    return sum;
+}
+
+static double mbPerSecond(int64_t bytes, int64_t ns)
+{
+    return ns ? double(bytes) * 1000.0 / ns : 0;
+}
+
+// Page size backing the mapping at 'addr', from /proc/self/smaps.
+static void getPageSize(const void* addr, char* buf, size_t len)
+{
+    snprintf(buf, len, "?");
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (!f)
+        return;
+    char line[256];
+    bool found = false;
+    unsigned long pageKb = 0, thpKb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end, kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            if (found)
+                break;
+            found = uintptr_t(addr) >= start && uintptr_t(addr) < end;
+        } else if (found) {
+            if (sscanf(line, "KernelPageSize: %lu kB", &kb) == 1)
+                pageKb = kb;
+            else if (sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1 ||
+                    sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+                thpKb += kb;
+        }
+    }
+    fclose(f);
+    if (thpKb)
+        snprintf(buf, len, "thp %luK", thpKb);
+    else if (pageKb)
+        snprintf(buf, len, "%luK", pageKb);
+}
+
+static void walk(const char* name, const test_buffer& b, const test_size& size,
+        int iterations)
+{
+    int64_t bytes = int64_t(size.width) * size.height * 4 * iterations;
+    uint32_t sum = 0;
+    // fault everything in before timing
+    memset(b.base, 0x5a, size_t(b.stride) * size.height * 4);
+
+    int64_t start = now_ns();
+    for (int i = 0; i < iterations; i++)
+        sum += rowWalk(b, size.width, size.height);
+    int64_t rowNs = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < iterations; i++)
+        sum += tileWalk(b, size.width, size.height);
+    int64_t tileNs = now_ns() - start;
+
+    char pageSize[32];
+    getPageSize(b.base, pageSize, sizeof(pageSize));
+    printf("%5dx%-5d %-8s %-10s row %8.1f MB/s  tile %8.1f MB/s  (%08x)\n",
+            size.width, size.height, name, pageSize,
+            mbPerSecond(bytes, rowNs), mbPerSecond(bytes, tileNs), sum);
+}
+
+static void runTest(alloc_device_t* alloc, gralloc_module_t const* module,
+        const test_size& size, int iterations)
+{
+    int usage = GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN;
+    buffer_handle_t handle;
+    test_buffer b;
+    void* vaddr;
+
+    int err = alloc->alloc(alloc, size.width, size.height,
+            HAL_PIXEL_FORMAT_RGBA_8888, usage, &handle, &b.stride);
+    if (err < 0) {
+        fprintf(stderr, "cannot allocate %dx%d buffer: %s\n",
+                size.width, size.height, strerror(-err));
+        return;
+    }
+    err = module->lock(module, handle, usage, 0, 0, size.width, size.height,
+            &vaddr);
+    if (err == 0) {
+        b.base = (uint32_t*)vaddr;
+        walk("gralloc", b, size, iterations);
+        module->unlock(module, handle);
+    }
+    alloc->free(alloc, handle);
+
+    // the same buffer, mapped the way gralloc did before huge pages
+    size_t bytes = size_t(b.stride) * size.height * 4;
+    int fd = ashmem_create_region("gralloc-benchmark", bytes);
+    if (fd < 0) {
+        fprintf(stderr, "cannot create ashmem region: %s\n", strerror(errno));
+        return;
+    }
+    vaddr = mmap(0, bytes, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (vaddr != MAP_FAILED) {
+        b.base = (uint32_t*)vaddr;
+        walk("4K", b, size, iterations);
+        munmap(vaddr, bytes);
+    }
+    close(fd);
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    hw_module_t const* module;
+    alloc_device_t* alloc;
+    int err;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [<iterations>]\n", argv[0]);
+        return 1;
+    }
+
+    err = hw_get_module(GRALLOC_HARDWARE_MODULE_ID, &module);
+    if (err < 0) {
+        fprintf(stderr, "cannot load gralloc: %s\n", strerror(-err));
+        return 1;
+    }
+    err = gralloc_open(module, &alloc);
+    if (err < 0) {
+        fprintf(stderr, "cannot open gralloc: %s\n", strerror(-err));
+        return 1;
+    }
+
+    gralloc_module_t const* gralloc = (gralloc_module_t const*)module;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        runTest(alloc, gralloc, sizes[i], iterations);
+
+    gralloc_close(alloc);
+    return 0;
+}
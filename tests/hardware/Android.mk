@@ -0,0 +1,16 @@
+LOCAL_PATH:= $(call my-dir)
+
+# Module copied under various names by hardware_benchmark
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := bench_module.c
+LOCAL_MODULE := libhardware_bench_module
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := hardware_benchmark.c
+LOCAL_SHARED_LIBRARIES := libcutils libhardware
+LOCAL_REQUIRED_MODULES := libhardware_bench_module
+LOCAL_MODULE := hardware_benchmark
+LOCAL_MODULE_TAGS := tests
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+
+#include <hardware/hardware.h>
+
+static int bench_device_open(const struct hw_module_t *module, const char *name,
+        struct hw_device_t **device)
+{
+    return -ENODEV;
+}
+
+static struct hw_module_methods_t bench_module_methods = {
+    .open = bench_device_open,
+};
+
+struct hw_module_t HAL_MODULE_INFO_SYM = {
+    .tag = HARDWARE_MODULE_TAG,
+    .module_api_version = HARDWARE_MODULE_API_VERSION(1, 0),
+    .hal_api_version = HARDWARE_HAL_API_VERSION,
+    .id = "bench",
+    .name = "libhardware benchmark module",
+    .author = "The Android Open Source Project",
+    .methods = &bench_module_methods,
+};
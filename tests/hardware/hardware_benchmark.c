@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2013 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures the cost of hw_get_module_by_class().
+ *
+ * The benchmark module is copied into a temporary directory under several
+ * names, and the loader is pointed at that directory through the
+ * HAL_LIBRARY_PATH environment variable, which the loader only honors on
+ * debuggable builds. It then times:
+ *
+ *  - cold lookups, where the module is unloaded first,
+ *  - uncached lookups, where only the module cache is invalidated, so the
+ *    module is resolved again but dlopen() finds it already loaded,
+ *  - warm lookups, served from the module cache,
+ *  - warm lookups from several threads at once,
+ *
+ * for a module found under the first variant key (ro.hardware) and for one
+ * only found as "default", after missing every variant key.
+ *
+ * usage: hardware_benchmark [<benchmark module> [<iterations>]]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/properties.h>
+#include <hardware/hardware.h>
+
+#define BENCH_MODULE_PATH "/system/lib/libhardware_bench_module.so"
+#define BENCH_CLASS "bench"
+#define DEFAULT_ITERATIONS 1000
+#define MAX_THREADS 8
+
+static const char *variant_keys[] = {
+    "ro.hardware",
+    "ro.product.board",
+    "ro.board.platform",
+    "ro.arch"
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int copy_file(const char *from, const char *to)
+{
+    char buf[8192];
+    ssize_t n;
+    int in, out, status = 0;
+
+    in = open(from, O_RDONLY);
+    if (in < 0)
+        return -errno;
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        status = -errno;
+        close(in);
+        return status;
+    }
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            status = -EIO;
+            break;
+        }
+    }
+    if (n < 0)
+        status = -errno;
+    close(in);
+    close(out);
+    return status;
+}
+
+static int count_variant_misses(void)
+{
+    char prop[PROPERTY_VALUE_MAX];
+    size_t i;
+    int misses = 0;
+
+    for (i = 0; i < sizeof(variant_keys)/sizeof(variant_keys[0]); i++) {
+        if (property_get(variant_keys[i], prop, NULL) > 0)
+            misses++;
+    }
+    return misses;
+}
+
+static void report(const char *what, int64_t elapsed_ns, int count)
+{
+    printf("  %-28s %10.2f us/lookup (%d lookups)\n", what,
+            (double)elapsed_ns / count / 1000.0, count);
+}
+
+static int bench_sequential(const char *inst, int iterations)
+{
+    const struct hw_module_t *module;
+    int64_t start, elapsed;
+    int i, err;
+
+    /* cold: the module is loaded from scratch every time */
+    elapsed = 0;
+    for (i = 0; i < iterations; i++) {
+        hw_unload_module(BENCH_CLASS, inst);
+        start = now_ns();
+        err = hw_get_module_by_class(BENCH_CLASS, inst, &module);
+        elapsed += now_ns() - start;
+        if (err) {
+            fprintf(stderr, "couldn't load %s.%s (%s)\n", BENCH_CLASS, inst,
+                    strerror(-err));
+            return err;
+        }
+    }
+    report("cold", elapsed, iterations);
+
+    /* uncached: resolved again, but dlopen finds the module loaded */
+    elapsed = 0;
+    for (i = 0; i < iterations; i++) {
+        hw_invalidate_module_cache(BENCH_CLASS, inst);
+        start = now_ns();
+        hw_get_module_by_class(BENCH_CLASS, inst, &module);
+        elapsed += now_ns() - start;
+    }
+    report("uncached", elapsed, iterations);
+
+    /* warm: served from the module cache */
+    start = now_ns();
+    for (i = 0; i < iterations; i++)
+        hw_get_module_by_class(BENCH_CLASS, inst, &module);
+    report("warm", now_ns() - start, iterations);
+
+    return 0;
+}
+
+struct thread_args {
+    const char *inst;
+    int iterations;
+    pthread_mutex_t *lock;
+    pthread_cond_t *cond;
+    int *go;
+};
+
+static void *lookup_thread(void *arg)
+{
+    struct thread_args *args = arg;
+    const struct hw_module_t *module;
+    int i;
+
+    pthread_mutex_lock(args->lock);
+    while (!*args->go)
+        pthread_cond_wait(args->cond, args->lock);
+    pthread_mutex_unlock(args->lock);
+
+    for (i = 0; i < args->iterations; i++)
+        hw_get_module_by_class(BENCH_CLASS, args->inst, &module);
+    return NULL;
+}
+
+static void bench_concurrent(const char *inst, int num_threads, int iterations)
+{
+    pthread_t threads[MAX_THREADS];
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    struct thread_args args;
+    char what[64];
+    int64_t start;
+    int i, started, go = 0;
+
+    args.inst = inst;
+    args.iterations = iterations;
+    args.lock = &lock;
+    args.cond = &cond;
+    args.go = &go;
+
+    for (started = 0; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, lookup_thread, &args))
+            break;
+    }
+
+    pthread_mutex_lock(&lock);
+    go = 1;
+    start = now_ns();
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    /* wall time per lookup, across all threads */
+    snprintf(what, sizeof(what), "warm, %d threads", started);
+    report(what, now_ns() - start, started * iterations);
+}
+
+int main(int argc, char **argv)
+{
+    const char *module_path = argc > 1 ? argv[1] : BENCH_MODULE_PATH;
+    int iterations = argc > 2 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+    const char *tmp = getenv("TMPDIR");
+    char dir[PATH_MAX];
+    char paths[2][PATH_MAX];
+    char variant[PROPERTY_VALUE_MAX];
+    struct hw_module_cache_stats stats;
+    const char *insts[2] = { "variant", "default" };
+    int misses[2];
+    int i, n, err;
+
+    if (iterations <= 0) {
+        fprintf(stderr, "usage: %s [<benchmark module> [<iterations>]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/hwbench.XXXXXX",
+            tmp ? tmp : "/data/local/tmp");
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "couldn't create %s (%s)\n", dir, strerror(errno));
+        return 1;
+    }
+    setenv("HAL_LIBRARY_PATH", dir, 1);
+
+    /* bench.variant.<ro.hardware>.so is found by the first variant key */
+    misses[0] = 0;
+    if (property_get(variant_keys[0], variant, NULL) > 0) {
+        snprintf(paths[0], PATH_MAX, "%s/%s.%s.%s.so", dir, BENCH_CLASS,
+                insts[0], variant);
+    } else {
+        snprintf(paths[0], PATH_MAX, "%s/%s.%s.default.so", dir, BENCH_CLASS,
+                insts[0]);
+        misses[0] = count_variant_misses();
+    }
+
+    /* bench.default.default.so is only found after every variant key */
+    misses[1] = count_variant_misses();
+    snprintf(paths[1], PATH_MAX, "%s/%s.%s.default.so", dir, BENCH_CLASS,
+            insts[1]);
+
+    for (i = 0, err = 0; i < 2 && err == 0; i++)
+        err = copy_file(module_path, paths[i]);
+    if (err != 0) {
+        fprintf(stderr, "couldn't copy %s to %s (%s)\n", module_path, dir,
+                strerror(-err));
+        return 1;
+    }
+
+    for (i = 0; i < 2 && err == 0; i++) {
+        printf("%s.%s (%d variant key misses):\n", BENCH_CLASS, insts[i],
+                misses[i]);
+        err = bench_sequential(insts[i], iterations);
+        for (n = 1; n <= MAX_THREADS && err == 0; n *= 2)
+            bench_concurrent(insts[i], n, iterations);
+    }
+
+    hw_get_module_cache_stats(&stats);
+    printf("module cache: %u hits, %u misses\n", stats.hits, stats.misses);
+
+    for (i = 0; i < 2; i++) {
+        hw_unload_module(BENCH_CLASS, insts[i]);
+        unlink(paths[i]);
+    }
+    rmdir(dir);
+
+    return err ? 1 : 0;
+}